@@ -0,0 +1,175 @@
+#include "Batches.h"
+#include "Util.h"
+#include <chrono>
+#include <cmath>
+
+// makes room for size samples of dims inputs each in the batch buffers
+template <typename Scalar>
+static void reserveBatch(Batch<Scalar>& batch, int dims, int size) {
+	if (batch.inputBuffer.rows() != dims || batch.inputBuffer.cols() < size)
+		batch.inputBuffer.resize(dims, size);
+	if (batch.labelBuffer.size() < size)
+		batch.labelBuffer.resize(size);
+	batch.size = size;
+}
+template <typename Scalar>
+static void shiftImage(const unsigned char* src, Scalar* dst, int side, int dx, int dy) {
+	for (int y = 0; y < side; y++) {
+		int sy = y - dy;
+		for (int x = 0; x < side; x++) {
+			int sx = x - dx;
+			dst[y * side + x] = (sy >= 0 && sy < side && sx >= 0 && sx < side) ? src[sy * side + sx] : 0;
+		}
+	}
+}
+template <typename Scalar>
+void gatherBatch(const Eigen::Ref<const MatrixXu8>& inputs, const Eigen::Ref<const VectorXu8>& labels, int startIndex, int size, Batch<Scalar>& batch, int maxShift, std::mt19937* rng) {
+	int dims = (int)inputs.rows();
+	int side = (int)(std::sqrt((double)dims) + 0.5);
+	batch.sparse = false;
+	reserveBatch(batch, dims, size);
+	if (maxShift > 0 && rng != NULL && side * side == dims) {
+		std::uniform_int_distribution<int> shift(-maxShift, maxShift);
+		for (int j = 0; j < size; j++) {
+			int dx = shift(*rng);
+			int dy = shift(*rng);
+			shiftImage(inputs.col(startIndex + j).data(), batch.inputBuffer.col(j).data(), side, dx, dy);
+		}
+	}
+	else {
+		for (int j = 0; j < size; j++)
+			bytes_to_features(inputs.col(startIndex + j).data(), batch.inputBuffer.col(j).data(), dims, Scalar(1));
+	}
+	batch.labelBuffer.head(size) = labels.segment(startIndex, size).cast<int>();
+}
+
+SparseSamples::SparseSamples(const Eigen::Ref<const MatrixXu8>& inputs) : dims((int)inputs.rows()), count((int)inputs.cols()) {
+	colStart.reserve(count + 1);
+	colStart.push_back(0);
+	for (int j = 0; j < count; j++) {
+		const unsigned char* x = inputs.col(j).data();
+		for (int i = 0; i < dims; i++) {
+			if (x[i] != 0) {
+				rows.push_back(i);
+				values.push_back(x[i]);
+			}
+		}
+		colStart.push_back(rows.size());
+	}
+}
+template <typename Scalar>
+void gatherSparseBatch(const SparseSamples& sparse, const Eigen::Ref<const VectorXu8>& labels, int startIndex, int size, Batch<Scalar>& batch) {
+	batch.sparse = true;
+	reserveBatch(batch, sparse.dims, size);
+	batch.sparseInputs.resize(sparse.dims, size);
+	batch.sparseInputs.reserve(sparse.colStart[startIndex + size] - sparse.colStart[startIndex]);
+	std::vector<char> active(sparse.dims, 0);
+	for (int j = 0; j < size; j++) {
+		batch.sparseInputs.startVec(j);
+		for (size_t k = sparse.colStart[startIndex + j]; k < sparse.colStart[startIndex + j + 1]; k++) {
+			batch.sparseInputs.insertBack(sparse.rows[k], j) = Scalar(sparse.values[k]);
+			active[sparse.rows[k]] = 1;
+		}
+	}
+	batch.sparseInputs.finalize();
+	batch.activeFeatures.clear();
+	for (int i = 0; i < sparse.dims; i++)
+		if (active[i])
+			batch.activeFeatures.push_back(i);
+	batch.labelBuffer.head(size) = labels.segment(startIndex, size).cast<int>();
+}
+
+template <typename Scalar>
+BatchPipeline<Scalar>::BatchPipeline(int depth, int maxShift) : depth(depth), maxShift(maxShift), rng(12345), ring(depth),
+	inputData(NULL), labelData(NULL), sparse(NULL), maxDensity(0), dims(0), count(0), batchSize(1), produced(0), consumed(0), released(0), quit(false), stall(0) {
+	if (depth > 0)
+		worker = std::thread(&BatchPipeline<Scalar>::produce, this);
+}
+template <typename Scalar>
+BatchPipeline<Scalar>::~BatchPipeline() {
+	if (depth > 0) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			quit = true;
+		}
+		changed.notify_all();
+		worker.join();
+	}
+}
+template <typename Scalar>
+void BatchPipeline<Scalar>::start(const Eigen::Map<const MatrixXu8>& inputs, const Eigen::Map<const VectorXu8>& labels, int batchSize, bool shuffle, const SparseSamples* sparse, double maxDensity) {
+	// the batch order is drawn here so that rand() is only ever used from the caller's thread
+	std::vector<int> newOrder;
+	for (int startIndex = 0; startIndex < inputs.cols(); startIndex += batchSize)
+		newOrder.push_back(startIndex);
+	if (shuffle)
+		random_shuffle_in_place(newOrder);
+
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		inputData = inputs.data();
+		labelData = labels.data();
+		this->sparse = sparse;
+		this->maxDensity = maxDensity;
+		dims = (int)inputs.rows();
+		count = (int)inputs.cols();
+		this->batchSize = batchSize;
+		order.swap(newOrder);
+		produced = consumed = released = 0;
+	}
+	changed.notify_all();
+}
+template <typename Scalar>
+void BatchPipeline<Scalar>::fill(int index, Batch<Scalar>& batch) {
+	int startIndex = order[index];
+	int actualSize = (batchSize > count - startIndex ? count - startIndex : batchSize);
+	// the kernel follows the measured density of each batch
+	if (sparse != NULL && maxShift == 0 && sparse->density(startIndex, actualSize) <= maxDensity) {
+		gatherSparseBatch(*sparse, Eigen::Map<const VectorXu8>(labelData, count), startIndex, actualSize, batch);
+		return;
+	}
+	gatherBatch(Eigen::Map<const MatrixXu8>(inputData, dims, count), Eigen::Map<const VectorXu8>(labelData, count), startIndex, actualSize, batch, maxShift, &rng);
+}
+template <typename Scalar>
+const Batch<Scalar>* BatchPipeline<Scalar>::next() {
+	if (depth == 0) {
+		if (consumed == (int)order.size())
+			return NULL;
+		fill(consumed, current);
+		consumed++;
+		return &current;
+	}
+
+	std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+	std::unique_lock<std::mutex> guard(lock);
+	// the batch handed out last time is no longer in use
+	released = consumed;
+	changed.notify_all();
+	if (consumed == (int)order.size())
+		return NULL;
+	changed.wait(guard, [this]() { return produced > consumed; });
+	stall += std::chrono::duration<double>(std::chrono::steady_clock::now() - waitStart).count();
+	return &ring[consumed++ % depth];
+}
+template <typename Scalar>
+void BatchPipeline<Scalar>::produce() {
+	std::unique_lock<std::mutex> guard(lock);
+	while (true) {
+		changed.wait(guard, [this]() { return quit || (produced < (int)order.size() && produced < released + depth); });
+		if (quit)
+			return;
+		// the slot is free and start() only runs once the pass is drained, so it can be filled unlocked
+		int index = produced;
+		guard.unlock();
+		fill(index, ring[index % depth]);
+		guard.lock();
+		produced++;
+		changed.notify_all();
+	}
+}
+template void gatherBatch<float>(const Eigen::Ref<const MatrixXu8>&, const Eigen::Ref<const VectorXu8>&, int, int, Batch<float>&, int, std::mt19937*);
+template void gatherBatch<double>(const Eigen::Ref<const MatrixXu8>&, const Eigen::Ref<const VectorXu8>&, int, int, Batch<double>&, int, std::mt19937*);
+template void gatherSparseBatch<float>(const SparseSamples&, const Eigen::Ref<const VectorXu8>&, int, int, Batch<float>&);
+template void gatherSparseBatch<double>(const SparseSamples&, const Eigen::Ref<const VectorXu8>&, int, int, Batch<double>&);
+template class BatchPipeline<float>;
+template class BatchPipeline<double>;
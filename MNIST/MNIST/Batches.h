@@ -0,0 +1,91 @@
+#pragma once
+#include "lib/Eigen/Core"
+#include "lib/Eigen/SparseCore"
+#include <condition_variable>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+#include "MIO.h"
+
+// A mini-batch in the form the network consumes, in its precision (float or double, which
+// Batches.cpp instantiates).
+template <typename Scalar>
+struct Batch {
+	// the size samples of the batch, in the leading columns of buffers that only ever grow, so that
+	// a pass reuses them for every batch, the last, partial one included
+	Eigen::Map<const MatrixX<Scalar> > inputs() const { return Eigen::Map<const MatrixX<Scalar> >(inputBuffer.data(), inputBuffer.rows(), size); }
+	Eigen::Map<const Eigen::VectorXi> labels() const { return Eigen::Map<const Eigen::VectorXi>(labelBuffer.data(), size); }
+	int size = 0;
+	MatrixX<Scalar> inputBuffer;
+	Eigen::VectorXi labelBuffer;
+	// set when the batch was taken from SparseSamples (see BatchPipeline::start): the inputs are
+	// then in sparseInputs alone, and activeFeatures lists the rows nonzero in at least one sample
+	bool sparse = false;
+	Eigen::SparseMatrix<Scalar> sparseInputs;
+	std::vector<int> activeFeatures;
+};
+
+// Byte samples in compressed sparse column form, converted once for a data set: the row and value
+// of every nonzero input, sample after sample. MNIST digits are about 80% zero pixels.
+struct SparseSamples {
+	explicit SparseSamples(const Eigen::Ref<const MatrixXu8>& inputs);
+	// fraction of nonzero inputs in the samples [startIndex, startIndex + size)
+	double density(int startIndex, int size) const { return (double)(colStart[startIndex + size] - colStart[startIndex]) / ((double)dims * size); }
+	int dims, count;
+	std::vector<size_t> colStart;
+	std::vector<int> rows;
+	std::vector<unsigned char> values;
+};
+
+// Converts the byte samples [startIndex, startIndex + size) to network inputs (raw 0..255 values).
+// With maxShift > 0 every sample, taken as a square image, is translated by up to maxShift pixels.
+template <typename Scalar>
+void gatherBatch(const Eigen::Ref<const MatrixXu8>& inputs, const Eigen::Ref<const VectorXu8>& labels, int startIndex, int size, Batch<Scalar>& batch, int maxShift = 0, std::mt19937* rng = NULL);
+
+// The samples [startIndex, startIndex + size) of sparse as a sparse batch.
+template <typename Scalar>
+void gatherSparseBatch(const SparseSamples& sparse, const Eigen::Ref<const VectorXu8>& labels, int startIndex, int size, Batch<Scalar>& batch);
+
+// Produces the mini-batches of a pass over a set of byte samples on a background thread,
+// into a ring of depth batch buffers, so that gathering, conversion and augmentation of the
+// next batches overlap with training on the current one. With depth 0 every batch is
+// gathered synchronously in next() instead.
+template <typename Scalar>
+class BatchPipeline {
+public:
+	explicit BatchPipeline(int depth, int maxShift = 0);
+	~BatchPipeline();
+	// Starts a pass over the samples in batches of batchSize, in random batch order when shuffle is set.
+	// The samples must stay alive until next() has returned NULL. Given the same samples as sparse, the
+	// batches with at most maxDensity nonzero inputs come out sparse (never with augmentation).
+	void start(const Eigen::Map<const MatrixXu8>& inputs, const Eigen::Map<const VectorXu8>& labels, int batchSize, bool shuffle, const SparseSamples* sparse = NULL, double maxDensity = 0);
+	// the next batch of the pass, or NULL at its end; the batch stays valid until the following call
+	const Batch<Scalar>* next();
+	// total time next() has waited for the producer
+	double stallSeconds() const { return stall; }
+private:
+	BatchPipeline(const BatchPipeline&);
+	BatchPipeline& operator=(const BatchPipeline&);
+	void produce();
+	void fill(int index, Batch<Scalar>& batch);
+
+	int depth;
+	int maxShift;
+	std::mt19937 rng;
+	std::vector<Batch<Scalar> > ring;
+	Batch<Scalar> current;
+	const unsigned char* inputData;
+	const unsigned char* labelData;
+	const SparseSamples* sparse;
+	double maxDensity;
+	int dims, count, batchSize;
+	std::vector<int> order;
+	// batches of the pass that were filled, handed out by next(), and given back to the producer
+	int produced, consumed, released;
+	bool quit;
+	double stall;
+	std::mutex lock;
+	std::condition_variable changed;
+	std::thread worker;
+};
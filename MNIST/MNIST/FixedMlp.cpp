@@ -0,0 +1,27 @@
+#include "FixedMlp.h"
+
+template <typename Net, typename Scalar>
+static bool tryTopology(const std::vector<MatrixX<Scalar> >& weights, std::unique_ptr<FixedNetwork<Scalar> >& net) {
+	if (!Net::matches(weights))
+		return false;
+	net.reset(new Net(weights));
+	return true;
+}
+
+// The topologies compiled in: the defaults of -nHidden and the usual small production networks.
+// Every one costs compile time and code size in both precisions, so add the ones you run.
+template <typename Scalar>
+std::unique_ptr<FixedNetwork<Scalar> > makeFixedNetwork(const std::vector<MatrixX<Scalar> >& weights) {
+	std::unique_ptr<FixedNetwork<Scalar> > net;
+	tryTopology<Mlp<Scalar, 784, 10> >(weights, net) ||
+		tryTopology<Mlp<Scalar, 784, 32, 10> >(weights, net) ||
+		tryTopology<Mlp<Scalar, 784, 64, 10> >(weights, net) ||
+		tryTopology<Mlp<Scalar, 784, 100, 10> >(weights, net) ||
+		tryTopology<Mlp<Scalar, 784, 128, 10> >(weights, net) ||
+		tryTopology<Mlp<Scalar, 784, 256, 10> >(weights, net) ||
+		tryTopology<Mlp<Scalar, 784, 128, 64, 10> >(weights, net) ||
+		tryTopology<Mlp<Scalar, 784, 256, 128, 10> >(weights, net);
+	return net;
+}
+template std::unique_ptr<FixedNetwork<float> > makeFixedNetwork(const std::vector<MatrixX<float> >& weights);
+template std::unique_ptr<FixedNetwork<double> > makeFixedNetwork(const std::vector<MatrixX<double> >& weights);
@@ -0,0 +1,112 @@
+#pragma once
+#include "lib/Eigen/Core"
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "MIO.h"
+#include "Util.h"
+
+// Inference on a trained network through a topology compiled in (see makeFixedNetwork), sample by
+// sample without touching the heap.
+template <typename Scalar>
+class FixedNetwork {
+public:
+	virtual ~FixedNetwork() {}
+	// the class probabilities of every column of inputs; probabilities is only resized when its size
+	// changes
+	virtual void forward(const Eigen::Ref<const MatrixXu8>& inputs, MatrixX<Scalar>& probabilities) const = 0;
+	// the layer sizes, as 784-64-10
+	virtual std::string topology() const = 0;
+};
+
+// The layers In -> Out -> Rest... of an Mlp, each a fixed-size map over the weights (column-major,
+// one layer after the other), with fixed-size activations: Eigen knows every dimension at compile
+// time, so the products need no temporaries on the heap and the small ones get unrolled.
+template <typename Scalar, int In, int Out, int... Rest>
+struct MlpLayers {
+	typedef MlpLayers<Scalar, Out, Rest...> Next;
+	enum { Classes = Next::Classes, Weights = In * Out + Next::Weights };
+	static void logits(const Scalar* w, const Eigen::Matrix<Scalar, In, 1>& x, Eigen::Matrix<Scalar, Classes, 1>& z) {
+		Eigen::Matrix<Scalar, Out, 1> h;
+		h.noalias() = Eigen::Map<const Eigen::Matrix<Scalar, Out, In> >(w) * x;
+		h = h.cwiseMax(Scalar(0));
+		Next::logits(w + (size_t)In * Out, h, z);
+	}
+	static bool matches(const MatrixX<Scalar>* w, size_t layers) {
+		return layers > 1 && w->rows() == Out && w->cols() == In && Next::matches(w + 1, layers - 1);
+	}
+	static void copy(const MatrixX<Scalar>* w, Scalar* to) {
+		Eigen::Map<Eigen::Matrix<Scalar, Out, In> > layer(to);
+		layer = *w;
+		Next::copy(w + 1, to + (size_t)In * Out);
+	}
+	static void name(std::ostringstream& s) {
+		s << In << "-";
+		Next::name(s);
+	}
+};
+template <typename Scalar, int In, int Out>
+struct MlpLayers<Scalar, In, Out> {
+	enum { Classes = Out, Weights = In * Out };
+	static void logits(const Scalar* w, const Eigen::Matrix<Scalar, In, 1>& x, Eigen::Matrix<Scalar, Out, 1>& z) {
+		z.noalias() = Eigen::Map<const Eigen::Matrix<Scalar, Out, In> >(w) * x;
+	}
+	static bool matches(const MatrixX<Scalar>* w, size_t layers) {
+		return layers == 1 && w->rows() == Out && w->cols() == In;
+	}
+	static void copy(const MatrixX<Scalar>* w, Scalar* to) {
+		Eigen::Map<Eigen::Matrix<Scalar, Out, In> > layer(to);
+		layer = *w;
+	}
+	static void name(std::ostringstream& s) {
+		s << In << "-" << Out;
+	}
+};
+
+// A ReLU network with the layer sizes Sizes (inputs first, classes last), e.g. Mlp<float, 784, 64, 10>.
+// The weights are copied once into a single block; a sample then goes through with its input,
+// activations and logits all fixed-size on the stack, ending in a softmax over the known number of
+// classes that Eigen unrolls.
+template <typename Scalar, int Inputs, int... Sizes>
+class Mlp : public FixedNetwork<Scalar> {
+public:
+	typedef MlpLayers<Scalar, Inputs, Sizes...> Layers;
+	enum { Classes = Layers::Classes };
+
+	// whether the trained weights have this topology
+	static bool matches(const std::vector<MatrixX<Scalar> >& weights) {
+		return Layers::matches(weights.data(), weights.size());
+	}
+	explicit Mlp(const std::vector<MatrixX<Scalar> >& weights) : w((Eigen::Index)Layers::Weights) {
+		Layers::copy(weights.data(), w.data());
+	}
+	// the class probabilities of one sample
+	void classify(const unsigned char* input, Eigen::Matrix<Scalar, Classes, 1>& probabilities) const {
+		Eigen::Matrix<Scalar, Inputs, 1> x = Eigen::Map<const Eigen::Matrix<unsigned char, Inputs, 1> >(input).template cast<Scalar>();
+		Layers::logits(w.data(), x, probabilities);
+		probabilities.array() -= probabilities.maxCoeff();
+		probabilities = probabilities.array().exp();
+		probabilities /= probabilities.sum();
+	}
+	void forward(const Eigen::Ref<const MatrixXu8>& inputs, MatrixX<Scalar>& probabilities) const {
+		probabilities.resize(Classes, inputs.cols());
+		Eigen::Matrix<Scalar, Classes, 1> p;
+		for (int j = 0; j < inputs.cols(); j++) {
+			classify(inputs.col(j).data(), p);
+			probabilities.col(j) = p;
+		}
+	}
+	std::string topology() const {
+		std::ostringstream s;
+		Layers::name(s);
+		return s.str();
+	}
+private:
+	VectorX<Scalar> w;
+};
+
+// The network with the topology of the trained weights, if it is one of those compiled in (see
+// FixedMlp.cpp), and NULL otherwise, for the dynamic network to be used instead.
+template <typename Scalar>
+std::unique_ptr<FixedNetwork<Scalar> > makeFixedNetwork(const std::vector<MatrixX<Scalar> >& weights);
@@ -0,0 +1,117 @@
+#include "Kernels.h"
+#include "lib/Eigen/Core"
+#include <cstring>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// what the CPU and the operating system support
+static bool cpuSupports(Isa isa) {
+	if (isa == ISA_SSE2)
+		return true;
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	bool fma = (info[2] & (1 << 12)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+	__cpuidex(info, 7, 0);
+	bool avx2 = (info[1] & (1 << 5)) != 0;
+	// F and BW, as /arch:AVX512 assumes (BW for the int16 products)
+	bool avx512 = (info[1] & (1 << 16)) != 0 && (info[1] & (1 << 30)) != 0;
+	// the OS saves the ymm (and for AVX-512 also the opmask and zmm) registers
+	bool ymm = (xcr0 & 0x6) == 0x6;
+	bool zmm = (xcr0 & 0xe6) == 0xe6;
+	if (isa == ISA_AVX2)
+		return avx2 && fma && ymm;
+	return avx512 && avx2 && fma && zmm;
+#else
+	__builtin_cpu_init();
+	bool avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+	if (isa == ISA_AVX2)
+		return avx2;
+	return avx2 && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+#endif
+}
+
+template <typename Scalar>
+void eigenGemm(int m, int n, int k, const Scalar* a, bool transA, const Scalar* b, bool transB, Scalar divisor, Scalar* c) {
+	typedef Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic> Matrix;
+	Eigen::Map<const Matrix> A(a, transA ? k : m, transA ? m : k), B(b, transB ? n : k, transB ? k : n);
+	Eigen::Map<Matrix> C(c, m, n);
+	if (!transA && !transB)
+		C.noalias() = A * B;
+	else if (!transA)
+		C.noalias() = A * B.transpose();
+	else if (!transB)
+		C.noalias() = A.transpose() * B;
+	else
+		C.noalias() = A.transpose() * B.transpose();
+	if (divisor != Scalar(1))
+		C /= divisor;
+}
+template void eigenGemm<float>(int m, int n, int k, const float* a, bool transA, const float* b, bool transB, float divisor, float* c);
+template void eigenGemm<double>(int m, int n, int k, const double* a, bool transA, const double* b, bool transB, double divisor, double* c);
+
+// a build is only offered for the instruction set its file is named after
+static bool usable(const IsaKernels& build, Isa isa) {
+	return build.compiledFor == isa && cpuSupports(isa);
+}
+
+struct Dispatch {
+	IsaKernels builds[ISA_COUNT];
+	int current;
+	Dispatch() {
+		getKernelsSse2(builds[ISA_SSE2]);
+		getKernelsAvx2(builds[ISA_AVX2]);
+		getKernelsAvx512(builds[ISA_AVX512]);
+		current = ISA_SSE2;
+		for (int isa = ISA_SSE2 + 1; isa < ISA_COUNT; isa++)
+			if (usable(builds[isa], (Isa)isa))
+				current = isa;
+	}
+};
+static Dispatch& dispatch() {
+	static Dispatch d;
+	return d;
+}
+
+const char* isaName(Isa isa) {
+	static const char* names[ISA_COUNT] = { "sse2", "avx2", "avx512" };
+	return names[isa];
+}
+const char* gemmKernelName(GemmKernel kernel) {
+	static const char* names[GEMM_KERNEL_COUNT] = { "auto", "Eigen", "tiny M", "small batch", "no pack" };
+	return names[kernel];
+}
+bool selectIsa(const char* name) {
+	Dispatch& d = dispatch();
+	if (!strcmp(name, "auto")) {
+		d = Dispatch();
+		return true;
+	}
+	for (int isa = 0; isa < ISA_COUNT; isa++) {
+		if (!strcmp(name, isaName((Isa)isa))) {
+			if (!usable(d.builds[isa], (Isa)isa))
+				return false;
+			d.current = isa;
+			return true;
+		}
+	}
+	return false;
+}
+const IsaKernels& currentKernels() {
+	Dispatch& d = dispatch();
+	return d.builds[d.current];
+}
+template <>
+const KernelTable<float>& kernels<float>() {
+	return currentKernels().floatKernels;
+}
+template <>
+const KernelTable<double>& kernels<double>() {
+	return currentKernels().doubleKernels;
+}
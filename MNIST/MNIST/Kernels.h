@@ -0,0 +1,74 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// The hot kernels of training and evaluation, built once per instruction set: Kernels_SSE2.cpp,
+// Kernels_AVX2.cpp and Kernels_AVX512.cpp each compile Kernels.inl with their own compiler flags
+// (see MNIST.vcxproj), so that Eigen takes its SSE, AVX or AVX512 packet path there. At startup
+// the build for the best instruction set the CPU supports is picked, or the one given by -isa.
+// Every build is in a namespace of its own (see Kernels.inl) and the interface only has plain
+// arrays (matrices column-major), so no Eigen type crosses from one build into another.
+enum Isa { ISA_SSE2, ISA_AVX2, ISA_AVX512, ISA_COUNT };
+
+// The matrix product kernels. Eigen's general one packs both operands into panels sized for large
+// products first, which dominates at the network's extreme shapes, and is built for SSE2 only (see
+// eigenGemm below), so these take over:
+// - tiny M (at most 16 rows of results, the output layer): every column of op(a) is a packet or two
+//   in registers, multiplied by broadcast elements of op(b) for 4 result columns at a time, with a
+//   read in place (see tiny_m_product in Kernels.inl)
+// - small batch (at most 8 columns of results, online inference): the same register blocking over
+//   the rows of a, streaming a once per 4 columns; for a transposed, dot products of its columns
+// - no pack: those kernels for all other shapes, over blocks of a that stay in cache, a being
+//   transposed into scratch first where it is transposed
+// GEMM_AUTO picks one by shape (chooseGemm in Kernels.inl); -benchGemm times them all.
+enum GemmKernel { GEMM_AUTO, GEMM_EIGEN, GEMM_TINY_M, GEMM_SMALL_BATCH, GEMM_NO_PACK, GEMM_KERNEL_COUNT };
+
+template <typename Scalar>
+struct KernelTable {
+	// c = op(a) * op(b) / divisor, op transposing where asked; c is m x n, op(a) m x k
+	void (*gemm)(int m, int n, int k, const Scalar* a, bool transA, const Scalar* b, bool transB, Scalar divisor, Scalar* c);
+	// the same with the given kernel; false (and c untouched) where it does not handle the shape
+	bool (*gemmWith)(GemmKernel kernel, int m, int n, int k, const Scalar* a, bool transA, const Scalar* b, bool transB, Scalar divisor, Scalar* c);
+	// see linear_relu and linear_relu_gradient in Util.h; weights is rows x inner
+	void (*linearRelu)(int rows, int inner, int cols, const Scalar* weights, const Scalar* inputs, const Scalar* bias, Scalar* outputs);
+	void (*linearReluGradient)(int rows, int inner, int cols, const Scalar* weights, const Scalar* grads, const Scalar* vals, Scalar* result);
+	void (*relu)(Scalar* x, size_t n);
+	void (*softmax)(int rows, int cols, Scalar* x);
+	// the row of the largest value of every column, the first one on ties
+	void (*argmax)(int rows, int cols, const Scalar* x, int* result);
+	// see softmax_cross_entropy_gradient and logits_cross_entropy in Util.h
+	double (*softmaxCrossEntropyGradient)(int rows, int cols, Scalar* logits, const int* labels, int* hits);
+	double (*logitsCrossEntropy)(int rows, int cols, const Scalar* logits, const int* labels, int* hits);
+};
+
+// Everything one build provides. compiledFor is the instruction set the compiler was actually told
+// to use; where it falls short of the file's name (Kernels_AVX512.cpp with Visual Studio 2015,
+// which has no AVX-512 target) the build is not offered for that instruction set at all.
+struct IsaKernels {
+	Isa compiledFor;
+	KernelTable<float> floatKernels;
+	KernelTable<double> doubleKernels;
+	// acc (count x n) = weights * x in int32 for the int8 network (see Quantize.h): count weight rows
+	// and n sample columns of int8 and uint8 values, as int16 each stride long, a multiple of 32
+	void (*quantizedGemm)(const int16_t* weights, int count, int stride, const int16_t* x, int n, int32_t* acc);
+	const char* quantizedGemmName;
+};
+void getKernelsSse2(IsaKernels& kernels);
+void getKernelsAvx2(IsaKernels& kernels);
+void getKernelsAvx512(IsaKernels& kernels);
+
+// Eigen's own product, C.noalias() = op(A) * op(B), with the arguments of KernelTable::gemm: GEMM_EIGEN
+// of every build and the reference of -benchGemm. It is built once, with the default flags, in
+// Kernels.cpp: were the builds to compile it themselves, the linker would keep one build's copy of
+// Eigen's product code and run that for all of them.
+template <typename Scalar>
+void eigenGemm(int m, int n, int k, const Scalar* a, bool transA, const Scalar* b, bool transB, Scalar divisor, Scalar* c);
+
+const char* isaName(Isa isa);
+const char* gemmKernelName(GemmKernel kernel);
+// picks the build for "sse2", "avx2" or "avx512", or the best one the CPU runs ("auto"); false if
+// the name is unknown, there is no build for it or the CPU lacks that instruction set
+bool selectIsa(const char* name);
+// the build in use
+const IsaKernels& currentKernels();
+template <typename Scalar> const KernelTable<Scalar>& kernels();
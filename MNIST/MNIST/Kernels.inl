@@ -0,0 +1,736 @@
+// The kernels of Kernels.h, included once per instruction set by Kernels_<ISA>.cpp after it has
+// defined KERNEL_ISA (Sse2, Avx2 or Avx512). They are in a namespace of their own per build,
+// Kernels<ISA>, and only getKernels<ISA> and the plain arrays of Kernels.h leave it.
+#define KERNEL_CAT2(a, b) a##b
+#define KERNEL_CAT(a, b) KERNEL_CAT2(a, b)
+
+#include "Kernels.h"
+#include "lib/Eigen/Core"
+#include <algorithm>
+#include <cmath>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(__OPTIMIZE__)
+#error "Kernels.inl must be built optimized, see the namespace below"
+#endif
+
+namespace KERNEL_CAT(Kernels, KERNEL_ISA) {
+
+// Eigen templates instantiated with plain types, say Map<MatrixXf>, would be compiled by every build
+// under the same names, and the linker keeps one copy of each for all of them: AVX-512 code on an
+// SSE2 machine, or SSE2 code in the AVX-512 build. So every Eigen template used here is instantiated
+// with a type of this namespace: Contiguous is Eigen's default stride under a name of our own,
+// matrices and vectors are only maps over Scratch, and Eigen's product is not used here at all (see
+// eigenGemm in Kernels.h), nor setZero, whose constant expression is over the plain Matrix. Eigen's
+// packet functions (pmadd, ploadu, predux...) and functors (scalar_exp_op<float>...) are the
+// exception: their types are the same in every build that has them, and they are only kept apart by
+// being inlined. So the builds are optimized in Debug too (see MNIST.vcxproj), and not building
+// them optimized is an error where the compiler tells.
+struct Contiguous : Eigen::Stride<0, 0> {};
+template <typename Scalar> using Mat = Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic>;
+template <typename Scalar> using RowVec = Eigen::Matrix<Scalar, 1, Eigen::Dynamic>;
+template <typename Scalar> using MatMap = Eigen::Map<Mat<Scalar>, 0, Contiguous>;
+template <typename Scalar> using ConstMatMap = Eigen::Map<const Mat<Scalar>, 0, Contiguous>;
+template <typename Scalar> using RowMap = Eigen::Map<RowVec<Scalar>, 0, Contiguous>;
+
+// scratch for one use per thread, only ever grown, aligned for the packets
+template <typename Scalar>
+class Scratch
+{
+public:
+	~Scratch()
+	{
+		Eigen::internal::aligned_free(data);
+	}
+	Scalar* get(size_t size)
+	{
+		if (size > capacity)
+		{
+			Eigen::internal::aligned_free(data);
+			data = (Scalar*)Eigen::internal::aligned_malloc(size * sizeof(Scalar));
+			capacity = size;
+		}
+		return data;
+	}
+private:
+	Scalar* data = nullptr;
+	size_t capacity = 0;
+};
+
+// The kernel for a shape (see GemmKernel in Kernels.h), from the measurements of -benchGemm with SSE2,
+// AVX2 and AVX-512 in both precisions: tiny M wins at every batch size, the small batch kernels at
+// up to 8 samples (2x at one) and the unpacked ones everywhere else, by 3x and more over Eigen's
+// product for the large products of training with AVX2 and AVX-512 (Eigen's is built for SSE2, see
+// eigenGemm in Kernels.h). Eigen's is left for both operands transposed, which the network never
+// asks for.
+GemmKernel chooseGemm(int m, int n, int k, bool transA, bool transB)
+{
+	if (m <= 16)
+		return GEMM_TINY_M;
+	if (transA && transB)
+		return GEMM_EIGEN;
+	if (n <= 8)
+		return GEMM_SMALL_BATCH;
+	return GEMM_NO_PACK;
+}
+
+// stores a packet of results, or adds it to what is there
+template <bool Add, typename Scalar, typename Packet>
+inline void store(Scalar* c, const Packet& x)
+{
+	Eigen::internal::pstoreu(c, Add ? Eigen::internal::padd(x, Eigen::internal::ploadu<Packet>(c)) : x);
+}
+
+// Three packets of rows times 4 columns of c = a * op(b), where a has column stride lda and
+// op(b)(kk, j) is b[kk * rsB + j * csB]: every step loads three packets of a column of a and
+// multiplies them by 4 broadcast elements of op(b), the 12 accumulators staying in registers (with
+// the packets of a and a broadcast, all 16 of SSE2 and AVX2). The accumulators are spelled out, as
+// compilers do not reliably keep arrays of them in registers.
+template <typename Scalar, bool Add>
+inline void axpy_block_3x4(int k, const Scalar* a, int lda, const Scalar* b, int rsB, int csB, Scalar* c, int ldc)
+{
+	using namespace Eigen::internal;
+	typedef typename packet_traits<Scalar>::type Packet;
+	const int P = packet_traits<Scalar>::size;
+	Packet c00 = pset1<Packet>(Scalar(0)), c01 = c00, c02 = c00, c03 = c00, c10 = c00, c11 = c00, c12 = c00, c13 = c00;
+	Packet c20 = c00, c21 = c00, c22 = c00, c23 = c00;
+	for (int kk = 0; kk < k; kk++, a += lda, b += rsB)
+	{
+		Packet a0 = ploadu<Packet>(a), a1 = ploadu<Packet>(a + P), a2 = ploadu<Packet>(a + 2 * P), bj;
+		bj = pset1<Packet>(b[0]); c00 = pmadd(a0, bj, c00); c10 = pmadd(a1, bj, c10); c20 = pmadd(a2, bj, c20);
+		bj = pset1<Packet>(b[csB]); c01 = pmadd(a0, bj, c01); c11 = pmadd(a1, bj, c11); c21 = pmadd(a2, bj, c21);
+		bj = pset1<Packet>(b[2 * csB]); c02 = pmadd(a0, bj, c02); c12 = pmadd(a1, bj, c12); c22 = pmadd(a2, bj, c22);
+		bj = pset1<Packet>(b[3 * csB]); c03 = pmadd(a0, bj, c03); c13 = pmadd(a1, bj, c13); c23 = pmadd(a2, bj, c23);
+	}
+	store<Add>(c, c00); store<Add>(c + P, c10); store<Add>(c + 2 * P, c20); c += ldc;
+	store<Add>(c, c01); store<Add>(c + P, c11); store<Add>(c + 2 * P, c21); c += ldc;
+	store<Add>(c, c02); store<Add>(c + P, c12); store<Add>(c + 2 * P, c22); c += ldc;
+	store<Add>(c, c03); store<Add>(c + P, c13); store<Add>(c + 2 * P, c23);
+}
+
+// two packets of rows times 4 columns, where there are not three packets of rows left
+template <typename Scalar, bool Add>
+inline void axpy_block_2x4(int k, const Scalar* a, int lda, const Scalar* b, int rsB, int csB, Scalar* c, int ldc)
+{
+	using namespace Eigen::internal;
+	typedef typename packet_traits<Scalar>::type Packet;
+	const int P = packet_traits<Scalar>::size;
+	Packet c00 = pset1<Packet>(Scalar(0)), c01 = c00, c02 = c00, c03 = c00, c10 = c00, c11 = c00, c12 = c00, c13 = c00;
+	for (int kk = 0; kk < k; kk++, a += lda, b += rsB)
+	{
+		Packet a0 = ploadu<Packet>(a), a1 = ploadu<Packet>(a + P);
+		Packet b0 = pset1<Packet>(b[0]), b1 = pset1<Packet>(b[csB]), b2 = pset1<Packet>(b[2 * csB]), b3 = pset1<Packet>(b[3 * csB]);
+		c00 = pmadd(a0, b0, c00); c10 = pmadd(a1, b0, c10);
+		c01 = pmadd(a0, b1, c01); c11 = pmadd(a1, b1, c11);
+		c02 = pmadd(a0, b2, c02); c12 = pmadd(a1, b2, c12);
+		c03 = pmadd(a0, b3, c03); c13 = pmadd(a1, b3, c13);
+	}
+	store<Add>(c, c00); store<Add>(c + P, c10); c += ldc;
+	store<Add>(c, c01); store<Add>(c + P, c11); c += ldc;
+	store<Add>(c, c02); store<Add>(c + P, c12); c += ldc;
+	store<Add>(c, c03); store<Add>(c + P, c13);
+}
+
+// one packet of rows times 4 columns, where there are not two packets of rows left
+template <typename Scalar, bool Add>
+inline void axpy_block_1x4(int k, const Scalar* a, int lda, const Scalar* b, int rsB, int csB, Scalar* c, int ldc)
+{
+	using namespace Eigen::internal;
+	typedef typename packet_traits<Scalar>::type Packet;
+	Packet c0 = pset1<Packet>(Scalar(0)), c1 = c0, c2 = c0, c3 = c0;
+	for (int kk = 0; kk < k; kk++, a += lda, b += rsB)
+	{
+		Packet a0 = ploadu<Packet>(a);
+		c0 = pmadd(a0, pset1<Packet>(b[0]), c0);
+		c1 = pmadd(a0, pset1<Packet>(b[csB]), c1);
+		c2 = pmadd(a0, pset1<Packet>(b[2 * csB]), c2);
+		c3 = pmadd(a0, pset1<Packet>(b[3 * csB]), c3);
+	}
+	store<Add>(c, c0); c += ldc;
+	store<Add>(c, c1); c += ldc;
+	store<Add>(c, c2); c += ldc;
+	store<Add>(c, c3);
+}
+
+// one packet of rows times one column, for the edges
+template <typename Scalar, bool Add>
+inline void axpy_block_1x1(int k, const Scalar* a, int lda, const Scalar* b, int rsB, Scalar* c)
+{
+	using namespace Eigen::internal;
+	typedef typename packet_traits<Scalar>::type Packet;
+	Packet c0 = pset1<Packet>(Scalar(0)), c1 = c0;
+	int kk = 0;
+	// two accumulators, to hide the latency of the multiply-adds
+	for (; kk + 2 <= k; kk += 2, a += 2 * lda, b += 2 * rsB)
+	{
+		c0 = pmadd(ploadu<Packet>(a), pset1<Packet>(b[0]), c0);
+		c1 = pmadd(ploadu<Packet>(a + lda), pset1<Packet>(b[rsB]), c1);
+	}
+	if (kk < k)
+		c0 = pmadd(ploadu<Packet>(a), pset1<Packet>(b[0]), c0);
+	store<Add>(c, padd(c0, c1));
+}
+
+// c (m x n, column stride ldc) = a * op(b) as above, or c += a * op(b) with Add, vectorized along the
+// rows of a, which is read in place: once for every 4 columns of c
+template <typename Scalar, bool Add>
+void axpy_panel(int m, int n, int k, const Scalar* a, int lda, const Scalar* b, int rsB, int csB, Scalar* c, int ldc)
+{
+	const int P = Eigen::internal::packet_traits<Scalar>::size;
+	int full = m - m % P;
+	for (int j0 = 0; j0 < n; j0 += 4)
+	{
+		int nb = std::min(4, n - j0);
+		const Scalar* bj = b + (size_t)j0 * csB;
+		Scalar* cj = c + (size_t)j0 * ldc;
+		int i0 = 0;
+		if (nb == 4)
+		{
+			for (; i0 + 3 * P <= full; i0 += 3 * P)
+				axpy_block_3x4<Scalar, Add>(k, a + i0, lda, bj, rsB, csB, cj + i0, ldc);
+			for (; i0 + 2 * P <= full; i0 += 2 * P)
+				axpy_block_2x4<Scalar, Add>(k, a + i0, lda, bj, rsB, csB, cj + i0, ldc);
+			for (; i0 < full; i0 += P)
+				axpy_block_1x4<Scalar, Add>(k, a + i0, lda, bj, rsB, csB, cj + i0, ldc);
+		}
+		for (; i0 < full; i0 += P)
+			for (int j = 0; j < nb; j++)
+				axpy_block_1x1<Scalar, Add>(k, a + i0, lda, bj + (size_t)j * csB, rsB, cj + i0 + (size_t)j * ldc);
+		for (; i0 < m; i0++)
+			for (int j = 0; j < nb; j++)
+			{
+				Scalar sum = Add ? cj[i0 + (size_t)j * ldc] : Scalar(0);
+				for (int kk = 0; kk < k; kk++)
+					sum += a[i0 + (size_t)kk * lda] * bj[(size_t)kk * rsB + (size_t)j * csB];
+				cj[i0 + (size_t)j * ldc] = sum;
+			}
+	}
+}
+
+// The same over blocks of a of at most 256 columns and 128 KB (half of a 256 KB L2): all of a larger
+// a would be read from memory again for every 4 columns of c, a block is read from memory once and
+// then from cache. The blocks after the first along k add to c.
+template <typename Scalar, bool Add>
+void axpy_product(int m, int n, int k, const Scalar* a, int lda, const Scalar* b, int rsB, int csB, Scalar* c, int ldc)
+{
+	const int P = Eigen::internal::packet_traits<Scalar>::size;
+	const int blockSize = 128 * 1024 / sizeof(Scalar);
+	int kc = std::min(k, 256), mc = m;
+	if ((size_t)mc * kc > (size_t)blockSize)
+		mc = std::max(3 * P, blockSize / kc / (3 * P) * (3 * P));
+	for (int k0 = 0; k0 == 0 || k0 < k; k0 += kc)
+	{
+		int kb = std::min(kc, k - k0);
+		for (int i0 = 0; i0 < m; i0 += mc)
+		{
+			int mb = std::min(mc, m - i0);
+			const Scalar* ab = a + i0 + (size_t)k0 * lda;
+			if (Add || k0 > 0)
+				axpy_panel<Scalar, true>(mb, n, kb, ab, lda, b + (size_t)k0 * rsB, rsB, csB, c + i0, ldc);
+			else
+				axpy_panel<Scalar, false>(mb, n, kb, ab, lda, b + (size_t)k0 * rsB, rsB, csB, c + i0, ldc);
+		}
+	}
+}
+
+// 4 x 2 results of c = a^T * b with a k x m and b k x n, both read in place: every result is a dot
+// product of two contiguous columns, vectorized along k and summed across the packet at the end
+template <typename Scalar>
+inline void dot_block_4x2(int k, const Scalar* a, const Scalar* b, Scalar* c, int ldc)
+{
+	using namespace Eigen::internal;
+	typedef typename packet_traits<Scalar>::type Packet;
+	const int P = packet_traits<Scalar>::size;
+	Packet c00 = pset1<Packet>(Scalar(0)), c01 = c00, c10 = c00, c11 = c00, c20 = c00, c21 = c00, c30 = c00, c31 = c00;
+	const Scalar *a0 = a, *a1 = a + k, *a2 = a + 2 * k, *a3 = a + 3 * k, *b0 = b, *b1 = b + k;
+	int full = k - k % P;
+	for (int kk = 0; kk < full; kk += P)
+	{
+		Packet v0 = ploadu<Packet>(b0 + kk), v1 = ploadu<Packet>(b1 + kk), w;
+		w = ploadu<Packet>(a0 + kk); c00 = pmadd(w, v0, c00); c01 = pmadd(w, v1, c01);
+		w = ploadu<Packet>(a1 + kk); c10 = pmadd(w, v0, c10); c11 = pmadd(w, v1, c11);
+		w = ploadu<Packet>(a2 + kk); c20 = pmadd(w, v0, c20); c21 = pmadd(w, v1, c21);
+		w = ploadu<Packet>(a3 + kk); c30 = pmadd(w, v0, c30); c31 = pmadd(w, v1, c31);
+	}
+	Scalar sums[4][2] = {
+		{ predux(c00), predux(c01) }, { predux(c10), predux(c11) }, { predux(c20), predux(c21) }, { predux(c30), predux(c31) } };
+	for (int i = 0; i < 4; i++)
+		for (int j = 0; j < 2; j++)
+		{
+			for (int kk = full; kk < k; kk++)
+				sums[i][j] += a[(size_t)i * k + kk] * b[(size_t)j * k + kk];
+			c[i + (size_t)j * ldc] = sums[i][j];
+		}
+}
+
+template <typename Scalar>
+inline Scalar dot(int k, const Scalar* a, const Scalar* b)
+{
+	return ConstMatMap<Scalar>(a, k, 1).col(0).dot(ConstMatMap<Scalar>(b, k, 1).col(0));
+}
+
+template <typename Scalar>
+void dot_product(int m, int n, int k, const Scalar* a, const Scalar* b, Scalar* c)
+{
+	int j0 = 0, i0;
+	for (; j0 + 2 <= n; j0 += 2)
+	{
+		for (i0 = 0; i0 + 4 <= m; i0 += 4)
+			dot_block_4x2(k, a + (size_t)i0 * k, b + (size_t)j0 * k, c + i0 + (size_t)j0 * m, m);
+		for (; i0 < m; i0++)
+			for (int j = j0; j < j0 + 2; j++)
+				c[i0 + (size_t)j * m] = dot(k, a + (size_t)i0 * k, b + (size_t)j * k);
+	}
+	for (; j0 < n; j0++)
+		for (i0 = 0; i0 < m; i0++)
+			c[i0 + (size_t)j0 * m] = dot(k, a + (size_t)i0 * k, b + (size_t)j0 * k);
+}
+
+// c = op(a) * op(b) for at most 16 rows, as whole packets of rows padded to mp: the columns of c are
+// formed in a padded block and copied out. The packets of a column of a (not transposed) just read on
+// into the next column, their extra rows only giving padding rows of the block, so a is only copied
+// for its last columns, where they would read past its end (and transposed, into columns of mp).
+template <typename Scalar>
+void tiny_m_product(int m, int n, int k, const Scalar* a, bool transA, const Scalar* b, int rsB, int csB, Scalar* c)
+{
+	if (k == 0)
+	{
+		std::fill_n(c, (size_t)m * n, Scalar(0));
+		return;
+	}
+	const int P = Eigen::internal::packet_traits<Scalar>::size;
+	int mp = (m + P - 1) / P * P;
+	int kTail = transA ? k : std::min(k, (mp - 1) / m), kMain = k - kTail;
+	thread_local Scratch<Scalar> scratch;
+	Scalar* packed = scratch.get((size_t)mp * kTail);
+	MatMap<Scalar> tail(packed, mp, kTail);
+	if (transA)
+		tail.topRows(m) = ConstMatMap<Scalar>(a, k, m).transpose();
+	else
+		tail.topRows(m) = ConstMatMap<Scalar>(a + (size_t)kMain * m, m, kTail);
+	for (int kk = 0; kk < kTail; kk++)
+		std::fill(packed + (size_t)kk * mp + m, packed + (size_t)(kk + 1) * mp, Scalar(0));
+	EIGEN_ALIGN_MAX Scalar block[16 * 4];
+	for (int j0 = 0; j0 < n; j0 += 4)
+	{
+		int nb = std::min(4, n - j0);
+		const Scalar* bj = b + (size_t)j0 * csB;
+		if (kMain > 0)
+			axpy_product<Scalar, false>(mp, nb, kMain, a, m, bj, rsB, csB, block, mp);
+		if (kMain > 0 && kTail > 0)
+			axpy_product<Scalar, true>(mp, nb, kTail, packed, mp, bj + (size_t)kMain * rsB, rsB, csB, block, mp);
+		else if (kTail > 0)
+			axpy_product<Scalar, false>(mp, nb, kTail, packed, mp, bj, rsB, csB, block, mp);
+		for (int j = 0; j < nb; j++)
+			std::copy(block + j * mp, block + j * mp + m, c + (size_t)(j0 + j) * m);
+	}
+}
+
+template <typename Scalar>
+bool gemmWith(GemmKernel kernel, int m, int n, int k, const Scalar* a, bool transA, const Scalar* b, bool transB, Scalar divisor, Scalar* c)
+{
+	if (kernel == GEMM_AUTO)
+		kernel = chooseGemm(m, n, k, transA, transB);
+	// op(b)(kk, j) is b[kk * rsB + j * csB]
+	int rsB = transB ? n : 1, csB = transB ? 1 : k;
+	switch (kernel)
+	{
+	case GEMM_TINY_M:
+		if (m > 16)
+			return false;
+		tiny_m_product(m, n, k, a, transA, b, rsB, csB, c);
+		break;
+	case GEMM_SMALL_BATCH:
+	case GEMM_NO_PACK:
+		// the same kernels, only chosen for different shapes
+		if ((kernel == GEMM_SMALL_BATCH && n > 8) || (transA && transB))
+			return false;
+		if (!transA)
+			axpy_product<Scalar, false>(m, n, k, a, m, b, rsB, csB, c, m);
+		else if (n <= 8 && k >= 4 * Eigen::internal::packet_traits<Scalar>::size)
+			dot_product(m, n, k, a, b, c);
+		else
+		{
+			// short dot products, or enough columns to pay for transposing a once
+			thread_local Scratch<Scalar> scratch;
+			Scalar* packed = scratch.get((size_t)m * k);
+			MatMap<Scalar>(packed, m, k) = ConstMatMap<Scalar>(a, k, m).transpose();
+			axpy_product<Scalar, false>(m, n, k, packed, m, b, rsB, csB, c, m);
+		}
+		break;
+	default:
+		eigenGemm(m, n, k, a, transA, b, transB, Scalar(1), c);
+		break;
+	}
+	if (divisor != Scalar(1))
+	{
+		MatMap<Scalar> C(c, m, n);
+		C /= divisor;
+	}
+	return true;
+}
+
+template <typename Scalar>
+void gemm(int m, int n, int k, const Scalar* a, bool transA, const Scalar* b, bool transB, Scalar divisor, Scalar* c)
+{
+	gemmWith(GEMM_AUTO, m, n, k, a, transA, b, transB, divisor, c);
+}
+
+template <typename Scalar>
+void relu(Scalar* x, size_t n)
+{
+	for (size_t i = 0; i < n; i++)
+		if (x[i] < 0)
+			x[i] = 0;
+}
+
+// Works on blocks of columns small enough to stay in L1 across its passes: the column maxima are
+// subtracted first, so that exp (Eigen's vectorized polynomial pexp) can then run over the block's
+// contiguous storage with the vector lanes spanning several samples, followed by the column sums
+// and the normalization.
+template <typename Scalar>
+void softmax(int rows, int cols, Scalar* data)
+{
+	MatMap<Scalar> x(data, rows, cols);
+	int block = std::max(8, 4096 / std::max(rows, 1));
+	// the column statistics of a block, per thread and only ever grown, so that no call allocates
+	thread_local Scratch<Scalar> scratch;
+	Scalar* stats = scratch.get(2 * (size_t)block);
+	RowMap<Scalar> colMax(stats, block), colScale(stats + block, block);
+	for (int j0 = 0; j0 < cols; j0 += block)
+	{
+		int n = std::min(block, cols - j0);
+		auto b = x.middleCols(j0, n);
+		colMax.head(n) = b.colwise().maxCoeff();
+		b.rowwise() -= colMax.head(n);
+		b.array() = b.array().exp();
+		colScale.head(n) = b.colwise().sum().cwiseInverse();
+		b.array().rowwise() *= colScale.head(n).array();
+	}
+}
+
+// row of the largest of the rows values at z, the first one on ties
+template <typename Scalar>
+inline int column_argmax(const Scalar* z, int rows)
+{
+	int amax = 0;
+	for (int i = 1; i < rows; i++)
+		if (z[i] > z[amax])
+			amax = i;
+	return amax;
+}
+
+template <typename Scalar>
+void argmax(int rows, int cols, const Scalar* x, int* result)
+{
+	for (int j = 0; j < cols; j++)
+		result[j] = column_argmax(x + (size_t)j * rows, rows);
+}
+
+template <typename Scalar>
+double logits_cross_entropy(int rows, int cols, const Scalar* data, const int* labels, int* hits)
+{
+	ConstMatMap<Scalar> logits(data, rows, cols);
+	int block = std::max(8, 4096 / std::max(rows, 1));
+	// only one block of exponentials is ever held, the probabilities are never formed
+	thread_local Scratch<Scalar> scratch;
+	Scalar* blockData = scratch.get((size_t)(rows + 2) * block);
+	double loss = 0;
+	int count = 0;
+	for (int j0 = 0; j0 < cols; j0 += block)
+	{
+		int n = std::min(block, cols - j0);
+		MatMap<Scalar> shifted(blockData, rows, n);
+		RowMap<Scalar> colMax(blockData + (size_t)rows * block, n), labelLogit(blockData + (size_t)(rows + 1) * block, n);
+		for (int j = 0; j < n; j++)
+		{
+			const Scalar* z = logits.col(j0 + j).data();
+			int amax = column_argmax(z, rows);
+			colMax(j) = z[amax];
+			labelLogit(j) = z[labels[j0 + j]];
+			if (amax == labels[j0 + j])
+				count++;
+		}
+		shifted = logits.middleCols(j0, n);
+		shifted.rowwise() -= colMax;
+		shifted.array() = shifted.array().exp();
+		loss += (colMax.array() + shifted.colwise().sum().array().log() - labelLogit.array()).template cast<double>().sum();
+	}
+	if (hits != NULL)
+		*hits += count;
+	return loss;
+}
+
+// The whole output layer in one sweep over blocks of columns that stay in L1: turns the logits into
+// the gradient softmax(logits) - onehot(labels) in place, returns the summed cross entropy (from the
+// log-sum-exp, so it is finite even where a probability underflows) and adds the number of columns
+// whose largest logit is the label to *hits.
+template <typename Scalar>
+double softmax_cross_entropy_gradient(int rows, int cols, Scalar* data, const int* labels, int* hits)
+{
+	MatMap<Scalar> logits(data, rows, cols);
+	int block = std::max(8, 4096 / std::max(rows, 1));
+	// as in softmax
+	thread_local Scratch<Scalar> scratch;
+	Scalar* stats = scratch.get(4 * (size_t)block);
+	RowMap<Scalar> colMax(stats, block), colSum(stats + block, block), colScale(stats + 2 * block, block), labelLogit(stats + 3 * block, block);
+	double loss = 0;
+	int count = 0;
+	for (int j0 = 0; j0 < cols; j0 += block)
+	{
+		int n = std::min(block, cols - j0);
+		auto b = logits.middleCols(j0, n);
+		for (int j = 0; j < n; j++)
+		{
+			const Scalar* z = b.col(j).data();
+			int amax = column_argmax(z, rows);
+			colMax(j) = z[amax];
+			labelLogit(j) = z[labels[j0 + j]];
+			if (amax == labels[j0 + j])
+				count++;
+		}
+		b.rowwise() -= colMax.head(n);
+		b.array() = b.array().exp();
+		colSum.head(n) = b.colwise().sum();
+		loss += (colMax.head(n).array() + colSum.head(n).array().log() - labelLogit.head(n).array()).template cast<double>().sum();
+		colScale.head(n) = colSum.head(n).cwiseInverse();
+		b.array().rowwise() *= colScale.head(n).array();
+		for (int j = 0; j < n; j++)
+			b(labels[j0 + j], j) -= Scalar(1);
+	}
+	if (hits != NULL)
+		*hits += count;
+	return loss;
+}
+
+// Columns per block of the fused layer kernels: the block of results (rows x columns doubles) is kept
+// at about 2 MB so that it is still in cache when the epilogue runs over it, while the blocks stay
+// wide enough for the matrix product to run at full speed.
+int fused_block_cols(int rows)
+{
+	int cols = (262144 / std::max(rows, 1)) & ~7;
+	return std::max(cols, 8);
+}
+
+// outputs = max(weights * inputs + bias, 0), one block of columns at a time, applying the bias and
+// ReLU right after each block of the product instead of in a second pass over the whole matrix
+template <typename Scalar>
+void linear_relu(int rows, int inner, int cols, const Scalar* weightData, const Scalar* inputData, const Scalar* bias, Scalar* outputData)
+{
+	MatMap<Scalar> outputs(outputData, rows, cols);
+	int block = fused_block_cols(rows);
+	for (int j0 = 0; j0 < cols; j0 += block)
+	{
+		int n = std::min(block, cols - j0);
+		gemmWith(GEMM_AUTO, rows, n, inner, weightData, false, inputData + (size_t)j0 * inner, false, Scalar(1), outputData + (size_t)j0 * rows);
+		for (int j = j0; j < j0 + n; j++)
+		{
+			Scalar* col = outputs.col(j).data();
+			if (bias != NULL)
+				for (int i = 0; i < rows; i++)
+					col[i] = std::max(col[i] + bias[i], Scalar(0));
+			else
+				for (int i = 0; i < rows; i++)
+					col[i] = std::max(col[i], Scalar(0));
+		}
+	}
+}
+
+// result = relu_gradient(weights^T * grads, vals), masking each block of the product as it is
+// computed, without a temporary for the whole product
+template <typename Scalar>
+void linear_relu_gradient(int rows, int inner, int cols, const Scalar* weightData, const Scalar* gradData, const Scalar* valData, Scalar* resultData)
+{
+	// weights is rows x inner, the result inner x cols
+	ConstMatMap<Scalar> vals(valData, inner, cols);
+	MatMap<Scalar> result(resultData, inner, cols);
+	int block = fused_block_cols(inner);
+	for (int j0 = 0; j0 < cols; j0 += block)
+	{
+		int n = std::min(block, cols - j0);
+		gemmWith(GEMM_AUTO, inner, n, rows, weightData, true, gradData + (size_t)j0 * rows, false, Scalar(1), resultData + (size_t)j0 * inner);
+		for (int j = j0; j < j0 + n; j++)
+		{
+			Scalar* col = result.col(j).data();
+			const Scalar* val = vals.col(j).data();
+			for (int i = 0; i < inner; i++)
+				col[i] = (val[i] > 0 ? col[i] : Scalar(0));
+		}
+	}
+}
+
+template <typename Scalar>
+KernelTable<Scalar> kernelTable()
+{
+	KernelTable<Scalar> table;
+	table.gemm = gemm<Scalar>;
+	table.gemmWith = gemmWith<Scalar>;
+	table.linearRelu = linear_relu<Scalar>;
+	table.linearReluGradient = linear_relu_gradient<Scalar>;
+	table.relu = relu<Scalar>;
+	table.softmax = softmax<Scalar>;
+	table.argmax = argmax<Scalar>;
+	table.softmaxCrossEntropyGradient = softmax_cross_entropy_gradient<Scalar>;
+	table.logitsCrossEntropy = logits_cross_entropy<Scalar>;
+	return table;
+}
+
+// The int8 product of Quantize.h in int16: madd multiplies 32 (AVX-512BW), 16 (AVX2) or 8 (SSE2)
+// pairs of int16 and sums them pairwise into int32, which with int8 weights and uint8 activations can
+// neither saturate nor overflow, unlike maddubs on the bytes themselves.
+#if defined(__AVX512BW__)
+typedef __m512i Int16Vector;
+inline Int16Vector zeroVector() {
+	return _mm512_setzero_si512();
+}
+inline Int16Vector loadInt16(const int16_t* p) {
+	return _mm512_loadu_si512(p);
+}
+inline void maddStep(Int16Vector& acc, Int16Vector w, Int16Vector x) {
+	acc = _mm512_add_epi32(_mm512_madd_epi16(w, x), acc);
+}
+inline __m256i halvesAdded(Int16Vector a) {
+	return _mm256_add_epi32(_mm512_castsi512_si256(a), _mm512_extracti64x4_epi64(a, 1));
+}
+// the sums of the int32 lanes of a0, a1, a2 and a3
+inline __m128i horizontalSums(Int16Vector a0, Int16Vector a1, Int16Vector a2, Int16Vector a3) {
+	__m256i h = _mm256_hadd_epi32(_mm256_hadd_epi32(halvesAdded(a0), halvesAdded(a1)), _mm256_hadd_epi32(halvesAdded(a2), halvesAdded(a3)));
+	return _mm_add_epi32(_mm256_castsi256_si128(h), _mm256_extracti128_si256(h, 1));
+}
+const char* quantizedGemmName = "AVX-512BW";
+#elif defined(__AVX2__)
+typedef __m256i Int16Vector;
+inline Int16Vector zeroVector() {
+	return _mm256_setzero_si256();
+}
+inline Int16Vector loadInt16(const int16_t* p) {
+	return _mm256_loadu_si256((const __m256i*)p);
+}
+inline void maddStep(Int16Vector& acc, Int16Vector w, Int16Vector x) {
+	acc = _mm256_add_epi32(_mm256_madd_epi16(w, x), acc);
+}
+// the sums of the int32 lanes of a0, a1, a2 and a3
+inline __m128i horizontalSums(Int16Vector a0, Int16Vector a1, Int16Vector a2, Int16Vector a3) {
+	__m256i h = _mm256_hadd_epi32(_mm256_hadd_epi32(a0, a1), _mm256_hadd_epi32(a2, a3));
+	return _mm_add_epi32(_mm256_castsi256_si128(h), _mm256_extracti128_si256(h, 1));
+}
+const char* quantizedGemmName = "AVX2";
+#elif defined(EIGEN_VECTORIZE_SSE2)
+typedef __m128i Int16Vector;
+inline Int16Vector zeroVector() {
+	return _mm_setzero_si128();
+}
+inline Int16Vector loadInt16(const int16_t* p) {
+	return _mm_loadu_si128((const __m128i*)p);
+}
+inline void maddStep(Int16Vector& acc, Int16Vector w, Int16Vector x) {
+	acc = _mm_add_epi32(acc, _mm_madd_epi16(w, x));
+}
+inline __m128i horizontalSums(Int16Vector a0, Int16Vector a1, Int16Vector a2, Int16Vector a3) {
+	// a 4 x 4 transpose, added up on the way
+	__m128i s01 = _mm_add_epi32(_mm_unpacklo_epi32(a0, a1), _mm_unpackhi_epi32(a0, a1));
+	__m128i s23 = _mm_add_epi32(_mm_unpacklo_epi32(a2, a3), _mm_unpackhi_epi32(a2, a3));
+	return _mm_add_epi32(_mm_unpacklo_epi64(s01, s23), _mm_unpackhi_epi64(s01, s23));
+}
+const char* quantizedGemmName = "SSE2";
+#else
+const char* quantizedGemmName = "portable";
+#endif
+
+#ifdef EIGEN_VECTORIZE_SSE2
+// one weight row times one sample, for the last rows of a layer (count not a multiple of 4)
+inline int32_t dotInt16(const int16_t* w, const int16_t* x, int stride) {
+	const int V = sizeof(Int16Vector) / sizeof(int16_t);
+	Int16Vector a = zeroVector();
+	for (int i = 0; i < stride; i += V)
+		maddStep(a, loadInt16(w + i), loadInt16(x + i));
+	return _mm_cvtsi128_si32(horizontalSums(a, zeroVector(), zeroVector(), zeroVector()));
+}
+
+// 4 weight rows, stride apart, times 2 samples, the results going to 4 rows of 2 columns of acc
+// (column stride ldc): every load of a weight serves both samples
+inline void quantizedBlock4x2(int stride, const int16_t* w, const int16_t* x, int32_t* acc, int ldc) {
+	const int V = sizeof(Int16Vector) / sizeof(int16_t);
+	const int16_t *w0 = w, *w1 = w0 + stride, *w2 = w1 + stride, *w3 = w2 + stride, *x0 = x, *x1 = x + stride;
+	Int16Vector a00 = zeroVector(), a10 = a00, a20 = a00, a30 = a00, a01 = a00, a11 = a00, a21 = a00, a31 = a00;
+	for (int i = 0; i < stride; i += V) {
+		Int16Vector v0 = loadInt16(x0 + i), v1 = loadInt16(x1 + i), wv;
+		wv = loadInt16(w0 + i); maddStep(a00, wv, v0); maddStep(a01, wv, v1);
+		wv = loadInt16(w1 + i); maddStep(a10, wv, v0); maddStep(a11, wv, v1);
+		wv = loadInt16(w2 + i); maddStep(a20, wv, v0); maddStep(a21, wv, v1);
+		wv = loadInt16(w3 + i); maddStep(a30, wv, v0); maddStep(a31, wv, v1);
+	}
+	_mm_storeu_si128((__m128i*)acc, horizontalSums(a00, a10, a20, a30));
+	_mm_storeu_si128((__m128i*)(acc + ldc), horizontalSums(a01, a11, a21, a31));
+}
+
+// 4 weight rows times one sample, for an odd one out
+inline void quantizedBlock4x1(int stride, const int16_t* w, const int16_t* x, int32_t* acc) {
+	const int V = sizeof(Int16Vector) / sizeof(int16_t);
+	const int16_t *w0 = w, *w1 = w0 + stride, *w2 = w1 + stride, *w3 = w2 + stride;
+	Int16Vector a0 = zeroVector(), a1 = a0, a2 = a0, a3 = a0;
+	for (int i = 0; i < stride; i += V) {
+		Int16Vector v = loadInt16(x + i);
+		maddStep(a0, loadInt16(w0 + i), v);
+		maddStep(a1, loadInt16(w1 + i), v);
+		maddStep(a2, loadInt16(w2 + i), v);
+		maddStep(a3, loadInt16(w3 + i), v);
+	}
+	_mm_storeu_si128((__m128i*)acc, horizontalSums(a0, a1, a2, a3));
+}
+#else
+inline int32_t dotInt16(const int16_t* w, const int16_t* x, int stride) {
+	int32_t sum = 0;
+	for (int i = 0; i < stride; i++)
+		sum += (int32_t)w[i] * x[i];
+	return sum;
+}
+#endif
+
+// acc (count x n, column-major) = weights * x, the count weight rows and the n sample columns each
+// stride int16 long. The samples go in blocks of up to 64 KB, which stay in cache while the weight
+// rows pass over them 4 at a time, so that the rows are read from memory once per block instead of
+// once per sample.
+void quantizedGemm(const int16_t* weights, int count, int stride, const int16_t* x, int n, int32_t* acc) {
+	int block = std::max(2, 32768 / stride & ~1);
+	for (int j0 = 0; j0 < n; j0 += block) {
+		int j1 = std::min(j0 + block, n), o = 0;
+#ifdef EIGEN_VECTORIZE_SSE2
+		for (; o + 4 <= count; o += 4) {
+			const int16_t* w = weights + (size_t)o * stride;
+			int j = j0;
+			for (; j + 2 <= j1; j += 2)
+				quantizedBlock4x2(stride, w, x + (size_t)j * stride, acc + (size_t)j * count + o, count);
+			if (j < j1)
+				quantizedBlock4x1(stride, w, x + (size_t)j * stride, acc + (size_t)j * count + o);
+		}
+#endif
+		// the last rows (all of them without SSE2)
+		for (; o < count; o++)
+			for (int j = j0; j < j1; j++)
+				acc[(size_t)j * count + o] = dotInt16(weights + (size_t)o * stride, x + (size_t)j * stride, stride);
+	}
+}
+
+}
+
+void KERNEL_CAT(getKernels, KERNEL_ISA)(IsaKernels& kernels)
+{
+	using namespace KERNEL_CAT(Kernels, KERNEL_ISA);
+#if defined(__AVX512F__)
+	kernels.compiledFor = ISA_AVX512;
+#elif defined(__AVX2__) && defined(__FMA__)
+	kernels.compiledFor = ISA_AVX2;
+#elif defined(__AVX2__) && defined(_MSC_VER)
+	// /arch:AVX2 implies FMA but does not define __FMA__
+	kernels.compiledFor = ISA_AVX2;
+#else
+	kernels.compiledFor = ISA_SSE2;
+#endif
+	kernels.floatKernels = kernelTable<float>();
+	kernels.doubleKernels = kernelTable<double>();
+	kernels.quantizedGemm = quantizedGemm;
+	kernels.quantizedGemmName = quantizedGemmName;
+}
@@ -0,0 +1,3 @@
+// The kernels of Kernels.h for AVX2 and FMA, built with /arch:AVX2 (see MNIST.vcxproj)
+#define KERNEL_ISA Avx2
+#include "Kernels.inl"
@@ -0,0 +1,14 @@
+// The kernels of Kernels.h for AVX-512, built with /arch:AVX512 by the toolsets that have it (see
+// MNIST.vcxproj). Visual Studio 2015 has no AVX-512 target; built without it, this file gives the
+// SSE2 build, which the dispatch never takes for AVX-512 (see IsaKernels in Kernels.h).
+#ifdef __AVX512F__
+#define KERNEL_ISA Avx512
+#include "Kernels.inl"
+#else
+#include "Kernels.h"
+
+void getKernelsAvx512(IsaKernels& kernels)
+{
+	getKernelsSse2(kernels);
+}
+#endif
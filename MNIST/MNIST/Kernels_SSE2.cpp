@@ -0,0 +1,3 @@
+// The kernels of Kernels.h for the SSE2 baseline, built with the default flags
+#define KERNEL_ISA Sse2
+#include "Kernels.inl"
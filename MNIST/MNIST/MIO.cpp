@@ -1,5 +1,27 @@
 #pragma once
 #include "MIO.h"
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <glob.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <thread>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 
 extern bool verbose;
 std::ofstream openFile(const char* file, char mode) {
@@ -17,43 +39,6 @@ std::ofstream openFile(const char* file, char mode) {
 	return f;
 	
 }
-Eigen::MatrixXi matrixFromFile(const char* filename, int skip, char delim) {
-	Eigen::MatrixXi result;
-	std::string line;
-	
-	std::fstream f(filename);	
-	std::list<std::list<int>> rowList;
-	
-	int linecount = 0;
-	int cols = 0;
-	while (std::getline(f, line)) {
-		if (skip > 0) {
-			skip--; 
-			continue;
-		}
-		std::vector<std::string> tokens = split_string(line, delim);
-		std::list<int> row;	
-		
-		for (int i = 0; i < tokens.size(); i++) {
-			int val = std::atoi(tokens[i].c_str());
-			row.push_back(val);
-		}
-		rowList.push_back(row);
-		cols = row.size() > cols ? row.size(): cols;
-		linecount++;
-	}
-	int rix = 0;
-	result = Eigen::MatrixXi(linecount, cols);
-	for (std::list<std::list<int>>::iterator liter = rowList.begin(); liter != rowList.end(); ++liter) {
-		int cix = 0;
-		for (std::list<int>::iterator diter = (*liter).begin(); diter != (*liter).end(); ++diter) {
-			result(rix, cix) = (*diter);
-			cix++;
-		}
-		rix++;
-	}
-	return result;
-}
 Eigen::VectorXi vectorFromFile(const char* filename, int length, bool lenFromHeader) {
 	if (fopen(filename, "r") == NULL) {
 		std::cout << "WARNING: Target file " << filename << " not found!! Result will be empty vector!!" << std::endl;
@@ -77,3 +62,1110 @@ Eigen::VectorXi vectorFromFile(const char* filename, int length, bool lenFromHea
 	}
 	return result;
 }
+MappedFile::MappedFile(const char* filename) : ptr(NULL), len(0) {
+#ifdef _WIN32
+	fileHandle = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	mapHandle = NULL;
+	if (fileHandle == INVALID_HANDLE_VALUE) {
+		std::cout << "FAILURE: File path not found: " << filename << std::endl;
+		std::exit(1);
+	}
+	LARGE_INTEGER fileSize;
+	GetFileSizeEx(fileHandle, &fileSize);
+	len = (size_t)fileSize.QuadPart;
+	if (len > 0) {
+		mapHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapHandle != NULL)
+			ptr = (const unsigned char*)MapViewOfFile(mapHandle, FILE_MAP_READ, 0, 0, 0);
+	}
+#else
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		std::cout << "FAILURE: File path not found: " << filename << std::endl;
+		std::exit(1);
+	}
+	struct stat st;
+	fstat(fd, &st);
+	len = (size_t)st.st_size;
+	if (len > 0) {
+		void* p = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p != MAP_FAILED)
+			ptr = (const unsigned char*)p;
+	}
+#endif
+	if (len > 0 && ptr == NULL) {
+		std::cout << "FAILURE: Could not map file: " << filename << std::endl;
+		std::exit(1);
+	}
+}
+MappedFile::~MappedFile() {
+#ifdef _WIN32
+	if (ptr != NULL)
+		UnmapViewOfFile(ptr);
+	if (mapHandle != NULL)
+		CloseHandle(mapHandle);
+	CloseHandle(fileHandle);
+#else
+	if (ptr != NULL)
+		munmap((void*)ptr, len);
+	close(fd);
+#endif
+}
+static int readBigEndian32(const unsigned char* p) {
+	return (int)(((unsigned)p[0] << 24) | ((unsigned)p[1] << 16) | ((unsigned)p[2] << 8) | (unsigned)p[3]);
+}
+static void failIdx(const char* what, const char* filename) {
+	std::cout << "FAILURE: " << what << ": " << filename << std::endl;
+	std::exit(1);
+}
+IdxFile idxFromFile(const char* filename) {
+	IdxFile result;
+	// magic number: two zero bytes, the element type (0x08 = unsigned byte), the number of dims
+	unsigned char magic[4];
+	size_t count = 1;
+	if (isGzipFile(filename)) {
+		InputStream in(filename);
+		if (in.read((char*)magic, 4) != 4 || magic[0] != 0 || magic[1] != 0 || magic[2] != 0x08 || magic[3] == 0)
+			failIdx("Not an unsigned byte IDX file", filename);
+		for (int i = 0; i < magic[3]; i++) {
+			unsigned char dim[4];
+			if (in.read((char*)dim, 4) != 4)
+				failIdx("Truncated IDX file", filename);
+			result.dims.push_back(readBigEndian32(dim));
+			count *= result.dims.back();
+		}
+		std::shared_ptr<std::vector<unsigned char>> payload = std::make_shared<std::vector<unsigned char>>(count);
+		if (in.read((char*)payload->data(), count) != count)
+			failIdx("Truncated IDX file", filename);
+		result.storage = payload;
+		result.data = payload->data();
+		return result;
+	}
+
+	std::shared_ptr<MappedFile> file = std::make_shared<MappedFile>(filename);
+	result.storage = file;
+	const unsigned char* p = file->data();
+	size_t size = file->size();
+	if (size < 4 || p[0] != 0 || p[1] != 0 || p[2] != 0x08 || p[3] == 0)
+		failIdx("Not an unsigned byte IDX file", filename);
+	int ndims = p[3];
+	size_t header = 4 + 4 * (size_t)ndims;
+	if (size >= header) {
+		for (int i = 0; i < ndims; i++) {
+			result.dims.push_back(readBigEndian32(p + 4 + 4 * i));
+			count *= result.dims.back();
+		}
+	}
+	if (size < header || size - header < count)
+		failIdx("Truncated IDX file", filename);
+	result.data = p + header;
+	return result;
+}
+Eigen::Map<const MatrixXu8> idxImages(const IdxFile& idx) {
+	// IDX stores each sample contiguously, which is a column in Eigen's default storage order
+	int sampleSize = 1;
+	for (size_t i = 1; i < idx.dims.size(); i++)
+		sampleSize *= idx.dims[i];
+	return Eigen::Map<const MatrixXu8>(idx.data, sampleSize, idx.dims[0]);
+}
+Eigen::Map<const VectorXu8> idxLabels(const IdxFile& idx) {
+	return Eigen::Map<const VectorXu8>(idx.data, idx.dims[0]);
+}
+void samplesFromIdx(const char* imageFile, const char* labelFile, DataSet& data) {
+	IdxFile images = idxFromFile(imageFile);
+	IdxFile labels = idxFromFile(labelFile);
+	if (images.dims[0] != labels.dims[0]) {
+		std::cout << "FAILURE: " << imageFile << " has " << images.dims[0] << " samples but " << labelFile << " has " << labels.dims[0] << " labels" << std::endl;
+		std::exit(1);
+	}
+	data.storage.clear();
+	data.storage.push_back(images.storage);
+	data.storage.push_back(labels.storage);
+	data.dims = (int)idxImages(images).rows();
+	data.count = images.dims[0];
+	data.inputData = images.data;
+	data.labelData = labels.data;
+}
+// from_chars-style parse of one integer field; returns the position after the last digit. Values
+// past 255 are out of range for a sample anyway, so the digits stop counting there (any result
+// above 255 stands for all of them) and a long run of digits cannot overflow.
+static inline const char* parseCsvInt(const char* p, const char* end, int& value) {
+	while (p < end && *p == ' ')
+		p++;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) {
+		negative = *p == '-';
+		p++;
+	}
+	int v = 0;
+	while (p < end && (unsigned)(*p - '0') < 10u) {
+		if (v <= 255)
+			v = v * 10 + (*p - '0');
+		p++;
+	}
+	value = negative ? -v : v;
+	return p;
+}
+// end of the line starting at p (memchr is vectorized by the C runtime)
+static inline const char* findLineEnd(const char* p, const char* end) {
+	const char* nl = (const char*)memchr(p, '\n', end - p);
+	return nl == NULL ? end : nl;
+}
+static inline bool blankLine(const char* p, const char* lineEnd) {
+	while (p < lineEnd && (*p == ' ' || *p == '\r'))
+		p++;
+	return p == lineEnd;
+}
+static int countCsvFields(const char* p, const char* lineEnd, char delim) {
+	int fields = 1;
+	for (; p < lineEnd; p++)
+		if (*p == delim)
+			fields++;
+	return fields;
+}
+static size_t countCsvRows(const char* p, const char* end) {
+	size_t rows = 0;
+	while (p < end) {
+		const char* lineEnd = findLineEnd(p, end);
+		if (!blankLine(p, lineEnd))
+			rows++;
+		p = lineEnd + 1;
+	}
+	return rows;
+}
+// Parses the rows in [p, end) straight into their sample columns, starting at column firstRow.
+// Returns the number of rows written.
+static size_t parseCsvRows(const char* p, const char* end, char delim, int dims, unsigned char* inputs, unsigned char* labels, size_t firstRow, const char* filename) {
+	size_t row = firstRow;
+	while (p < end) {
+		const char* lineEnd = findLineEnd(p, end);
+		if (blankLine(p, lineEnd)) {
+			p = lineEnd + 1;
+			continue;
+		}
+		unsigned char* column = inputs + row * dims;
+		int value;
+		p = parseCsvInt(p, lineEnd, value);
+		unsigned outOfRange = (unsigned)value;
+		labels[row] = (unsigned char)value;
+		int i = 0;
+		while (p < lineEnd && *p == delim) {
+			p = parseCsvInt(p + 1, lineEnd, value);
+			if (i == dims) {
+				std::cout << "FAILURE: Row " << row + 1 << " of " << filename << " has more than " << dims + 1 << " fields" << std::endl;
+				std::exit(1);
+			}
+			outOfRange |= (unsigned)value;
+			column[i++] = (unsigned char)value;
+		}
+		if (outOfRange > 255u) {
+			std::cout << "FAILURE: Row " << row + 1 << " of " << filename << " has values outside 0..255" << std::endl;
+			std::exit(1);
+		}
+		// short rows are zero padded
+		for (; i < dims; i++)
+			column[i] = 0;
+		row++;
+		p = lineEnd + 1;
+	}
+	return row - firstRow;
+}
+// owned storage for count samples; returns the features, the labels follow them
+static unsigned char* allocateSamples(DataSet& data, int dims, size_t count) {
+	std::shared_ptr<std::vector<unsigned char>> buffer = std::make_shared<std::vector<unsigned char>>(count * (dims + 1));
+	data.storage.assign(1, buffer);
+	data.dims = dims;
+	data.count = count;
+	data.inputData = buffer->data();
+	data.labelData = buffer->data() + count * dims;
+	return buffer->data();
+}
+// compressed text cannot be split up front, so it is parsed as it is inflated, a chunk at a time
+static void samplesFromCompressedCsv(const char* filename, DataSet& data) {
+	SampleStream stream(filename, 64 << 20, 1, false);
+	std::shared_ptr<std::vector<unsigned char>> inputs = std::make_shared<std::vector<unsigned char>>();
+	std::shared_ptr<std::vector<unsigned char>> labels = std::make_shared<std::vector<unsigned char>>();
+	while (stream.next()) {
+		inputs->insert(inputs->end(), stream.inputs().data(), stream.inputs().data() + stream.inputs().size());
+		labels->insert(labels->end(), stream.labels().data(), stream.labels().data() + stream.labels().size());
+	}
+	data.storage.clear();
+	data.storage.push_back(inputs);
+	data.storage.push_back(labels);
+	data.dims = stream.dims();
+	data.count = labels->size();
+	data.inputData = inputs->data();
+	data.labelData = labels->data();
+}
+void samplesFromCsv(const char* filename, DataSet& data, char delim) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	if (isGzipFile(filename)) {
+		samplesFromCompressedCsv(filename, data);
+		if (verbose)
+			std::cout << "Inflated and parsed " + std::string(filename) + " in " + std::to_string(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()) + " s\n";
+		return;
+	}
+	MappedFile file(filename);
+	const char* begin = (const char*)file.data();
+	const char* end = begin + file.size();
+
+	// the first non-blank row gives the sample dimension (all fields after the label)
+	const char* first = begin;
+	const char* firstEnd = findLineEnd(first, end);
+	while (first < end && blankLine(first, firstEnd)) {
+		first = firstEnd + 1;
+		firstEnd = first < end ? findLineEnd(first, end) : end;
+	}
+	int dims = first < end ? countCsvFields(first, firstEnd, delim) - 1 : 0;
+	if (first > end)
+		first = end;
+
+	// split at newline boundaries, roughly one chunk per core (but not less than a megabyte each)
+	size_t minChunk = 1 << 20;
+	int nChunks = (int)std::max<size_t>(1, std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), (end - first) / minChunk));
+	std::vector<const char*> bounds(nChunks + 1);
+	bounds[0] = first;
+	bounds[nChunks] = end;
+	for (int k = 1; k < nChunks; k++) {
+		const char* b = std::max(bounds[k - 1], first + (end - first) / nChunks * k);
+		const char* lineEnd = b < end ? findLineEnd(b, end) : end;
+		bounds[k] = lineEnd < end ? lineEnd + 1 : end;
+	}
+
+	// count the rows of every chunk to know where its samples go, then parse all chunks in place
+	std::vector<size_t> offsets(nChunks + 1, 0);
+	parallelFor(nChunks, [&](int k) {
+		offsets[k + 1] = countCsvRows(bounds[k], bounds[k + 1]);
+	});
+	for (int k = 0; k < nChunks; k++)
+		offsets[k + 1] += offsets[k];
+
+	unsigned char* inputs = allocateSamples(data, dims, offsets[nChunks]);
+	unsigned char* labels = inputs + offsets[nChunks] * dims;
+	parallelFor(nChunks, [&](int k) {
+		parseCsvRows(bounds[k], bounds[k + 1], delim, dims, inputs, labels, offsets[k], filename);
+	});
+
+	if (verbose) {
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		double mb = file.size() / (1024.0 * 1024.0);
+		// single write, other data sets may be loading at the same time
+		std::ostringstream msg;
+		msg << "Parsed " << mb << " MB from " << filename << " in " << seconds << " s (" << mb / seconds << " MB/s, " << nChunks << " threads)" << std::endl;
+		std::cout << msg.str();
+	}
+}
+static const char sampleCacheMagic[8] = { 'M', 'L', 'C', 'A', 'C', 'H', 'E', '1' };
+static std::string sampleCachePath(const char* source) {
+	return std::string(source) + ".mlcache";
+}
+static bool fileStat(const char* filename, uint64_t& size, int64_t& mtime) {
+#ifdef _WIN32
+	struct _stat64 st;
+	if (_stat64(filename, &st) != 0)
+		return false;
+#else
+	struct stat st;
+	if (stat(filename, &st) != 0)
+		return false;
+#endif
+	size = (uint64_t)st.st_size;
+	mtime = (int64_t)st.st_mtime;
+	return true;
+}
+// FNV-1a over 8 byte words, enough to tell a rewritten source from a touched one
+static uint64_t contentHash(const unsigned char* p, size_t n) {
+	uint64_t h = 14695981039346656037ull;
+	size_t i = 0;
+	for (; i + 8 <= n; i += 8) {
+		uint64_t w;
+		memcpy(&w, p + i, 8);
+		h = (h ^ w) * 1099511628211ull;
+	}
+	for (; i < n; i++)
+		h = (h ^ p[i]) * 1099511628211ull;
+	return h;
+}
+static size_t sampleCacheFeatureOffset(const SampleCacheHeader& header) {
+	return (sizeof(SampleCacheHeader) + (size_t)header.count + 7) & ~(size_t)7;
+}
+// reads the header of the cache for source and checks that the cache is complete and up to date
+static bool validSampleCache(const char* source, SampleCacheHeader& header) {
+	std::string path = sampleCachePath(source);
+	uint64_t sourceSize, cacheSize;
+	int64_t sourceMtime, cacheMtime;
+	if (!fileStat(source, sourceSize, sourceMtime) || !fileStat(path.c_str(), cacheSize, cacheMtime) || cacheSize < sizeof(SampleCacheHeader))
+		return false;
+
+	std::ifstream f(path.c_str(), std::ifstream::in | std::ifstream::binary);
+	if (!f.read((char*)&header, sizeof(header)))
+		return false;
+	if (memcmp(header.magic, sampleCacheMagic, 8) != 0 || header.featureType != 0
+		|| cacheSize != sampleCacheFeatureOffset(header) + header.count * header.dims)
+		return false;
+
+	// size and mtime are normally enough; a source that was only touched or copied is confirmed by its content
+	if (header.sourceSize != sourceSize)
+		return false;
+	if (header.sourceMtime != sourceMtime) {
+		MappedFile sourceFile(source);
+		if (contentHash(sourceFile.data(), sourceFile.size()) != header.sourceHash)
+			return false;
+	}
+	return true;
+}
+bool samplesFromCache(const char* source, DataSet& data) {
+	SampleCacheHeader header;
+	if (!validSampleCache(source, header))
+		return false;
+
+	std::string path = sampleCachePath(source);
+	std::shared_ptr<MappedFile> cache = std::make_shared<MappedFile>(path.c_str());
+	data.storage.assign(1, cache);
+	data.dims = header.dims;
+	data.count = (size_t)header.count;
+	data.labelData = cache->data() + sizeof(SampleCacheHeader);
+	data.inputData = cache->data() + sampleCacheFeatureOffset(header);
+	if (verbose)
+		std::cout << "Using cached copy " + path + " of " + source + "\n";
+	return true;
+}
+static int64_t currentProcess(); // with the shared memory segments below
+void writeSampleCache(const char* source, const DataSet& data) {
+	std::string path = sampleCachePath(source);
+	SampleCacheHeader header;
+	memcpy(header.magic, sampleCacheMagic, 8);
+	header.featureType = 0;
+	header.dims = (uint32_t)data.dims;
+	header.count = (uint64_t)data.count;
+	{
+		MappedFile sourceFile(source);
+		header.sourceHash = contentHash(sourceFile.data(), sourceFile.size());
+	}
+	if (!fileStat(source, header.sourceSize, header.sourceMtime))
+		return;
+
+	// write to a temporary file first so that a concurrent reader never sees a partial cache; the
+	// name is unique to this process and call, as other processes (or another load of the same file
+	// in this one) may be writing the same cache
+	static std::atomic<unsigned> writes(0);
+	std::string tmpPath = path + "." + std::to_string(currentProcess()) + "-" + std::to_string(writes++) + ".tmp";
+	std::ofstream f(tmpPath.c_str(), std::ofstream::out | std::ofstream::binary);
+	if (f.fail()) {
+		if (verbose)
+			std::cout << "WARNING: Could not write cache file " + tmpPath + "\n";
+		return;
+	}
+	f.write((const char*)&header, sizeof(header));
+	f.write((const char*)data.labelData, data.count);
+	std::vector<char> padding(sampleCacheFeatureOffset(header) - sizeof(header) - data.count, 0);
+	f.write(padding.data(), padding.size());
+	f.write((const char*)data.inputData, data.count * data.dims);
+	f.close();
+	std::remove(path.c_str());
+	if (f.fail() || std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+		std::remove(tmpPath.c_str());
+		if (verbose)
+			std::cout << "WARNING: Could not write cache file " + path + "\n";
+	}
+}
+static void seekFile(FILE* f, uint64_t offset) {
+#ifdef _WIN32
+	_fseeki64(f, (__int64)offset, SEEK_SET);
+#else
+	fseeko(f, (off_t)offset, SEEK_SET);
+#endif
+}
+SampleStream::SampleStream(const std::vector<std::string>& shards, size_t memoryBudget, int chunkMultiple, bool useCache) : shards(shards), useCache(useCache) {
+	init(memoryBudget, chunkMultiple);
+}
+SampleStream::SampleStream(const char* filename, size_t memoryBudget, int chunkMultiple, bool useCache) : shards(1, filename), useCache(useCache) {
+	init(memoryBudget, chunkMultiple);
+}
+void SampleStream::init(size_t memoryBudget, int chunkMultiple) {
+	file = NULL;
+	binary = false;
+	sampleDims = 0;
+	for (size_t i = 0; i < shards.size(); i++)
+		order.push_back((int)i);
+
+	// large sequential reads of CSV text, but never more than an eighth of the budget
+	text.resize(std::min<size_t>(16 << 20, std::max<size_t>(64 << 10, memoryBudget / 8)));
+	// the sample dimension comes from the first shard that has samples, as the chunks are sized by it
+	openShard(0);
+	front.fromCache = binary;
+	for (size_t i = 1; sampleDims == 0 && i < shards.size(); i++)
+		openShard((int)i);
+	if (sampleDims <= 0) {
+		std::cout << "FAILURE: No samples in " << (shards.size() > 1 ? "any of the shards of " : "") << shards[0] << std::endl;
+		std::exit(1);
+	}
+
+	// two chunks are resident (current and read-ahead), plus the text buffer
+	size_t perSample = 2 * (sampleDims + 1);
+	size_t overhead = text.size();
+	size_t multiple = std::max(1, chunkMultiple);
+	capacity = memoryBudget > overhead ? (memoryBudget - overhead) / perSample / multiple * multiple : 0;
+	capacity = std::max(capacity, multiple);
+	restart();
+}
+SampleStream::~SampleStream() {
+	if (pending.valid())
+		pending.wait();
+	if (file != NULL)
+		fclose(file);
+}
+void SampleStream::restart() {
+	// shuffled here rather than on the reading thread, so that rand() is only used by the caller
+	if (order.size() > 1)
+		random_shuffle_in_place(order);
+	openShard(0);
+	pending = std::async(std::launch::async, &SampleStream::readChunk, this, std::ref(back));
+}
+void SampleStream::openShard(int index) {
+	if (file != NULL)
+		fclose(file);
+	file = NULL;
+	textInput.reset();
+	shardIndex = index;
+	filename = shards[order[index]];
+	nextSample = 0;
+	eof = false;
+	textBegin = textEnd = 0;
+
+	int dims = 0;
+	binary = useCache && validSampleCache(filename.c_str(), header);
+	if (binary) {
+		std::string path = sampleCachePath(filename.c_str());
+		file = fopen(path.c_str(), "rb");
+		if (file == NULL) {
+			std::cout << "FAILURE: File path not found: " << path << std::endl;
+			std::exit(1);
+		}
+		dims = header.dims;
+	}
+	else {
+		// the first non-blank line gives the sample dimension; it stays in the buffer to be parsed
+		textInput.reset(new InputStream(filename.c_str()));
+		const char* first = NULL;
+		const char* firstEnd = NULL;
+		while (first == NULL && fillText()) {
+			const char* p = text.data() + textBegin;
+			const char* end = text.data() + textEnd;
+			while (p < end) {
+				const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+				if (lineEnd == NULL) {
+					if (!eof)
+						break;
+					lineEnd = end;
+				}
+				if (!blankLine(p, lineEnd)) {
+					first = p;
+					firstEnd = lineEnd;
+					break;
+				}
+				p = lineEnd + 1;
+			}
+		}
+		if (first == NULL)
+			return;
+		dims = countCsvFields(first, firstEnd, ',') - 1;
+	}
+	if (sampleDims == 0)
+		sampleDims = dims;
+	else if (dims != sampleDims) {
+		std::cout << "FAILURE: " << filename << " has " << dims << " dimensions, expected " << sampleDims << std::endl;
+		std::exit(1);
+	}
+}
+bool SampleStream::next() {
+	pending.get();
+	if (back.inputs.cols() == 0) {
+		restart();
+		return false;
+	}
+	std::swap(front, back);
+	pending = std::async(std::launch::async, &SampleStream::readChunk, this, std::ref(back));
+	return true;
+}
+// fills the chunk from as many shards as it takes
+void SampleStream::readChunk(Chunk& chunk) {
+	chunk.inputs.resize(sampleDims, capacity);
+	chunk.labels.resize(capacity);
+	chunk.fromCache = binary;
+	size_t rows = 0;
+	while (true) {
+		rows += binary ? readBinaryRows(chunk, rows) : readCsvRows(chunk, rows);
+		if (rows == capacity || shardIndex + 1 == (int)shards.size())
+			break;
+		openShard(shardIndex + 1);
+		chunk.fromCache = chunk.fromCache && binary;
+	}
+	chunk.inputs.conservativeResize(sampleDims, rows);
+	chunk.labels.conservativeResize(rows);
+}
+size_t SampleStream::readBinaryRows(Chunk& chunk, size_t rows) {
+	size_t n = (size_t)std::min<uint64_t>(capacity - rows, header.count - nextSample);
+	if (n == 0)
+		return 0;
+
+	seekFile(file, sizeof(SampleCacheHeader) + nextSample);
+	size_t labelsRead = fread(chunk.labels.data() + rows, 1, n, file);
+	seekFile(file, sampleCacheFeatureOffset(header) + nextSample * sampleDims);
+	if (labelsRead != n || fread(chunk.inputs.data() + rows * sampleDims, 1, n * sampleDims, file) != n * sampleDims) {
+		std::cout << "FAILURE: Could not read " << sampleCachePath(filename.c_str()) << std::endl;
+		std::exit(1);
+	}
+	nextSample += n;
+	return n;
+}
+// moves the unparsed text to the front of the buffer and appends as much of the file as fits
+bool SampleStream::fillText() {
+	if (eof)
+		return false;
+	if (textBegin > 0) {
+		memmove(text.data(), text.data() + textBegin, textEnd - textBegin);
+		textEnd -= textBegin;
+		textBegin = 0;
+	}
+	// a single line longer than the buffer
+	if (textEnd == text.size())
+		text.resize(text.size() * 2);
+	size_t n = textInput->read(text.data() + textEnd, text.size() - textEnd);
+	textEnd += n;
+	if (n == 0)
+		eof = true;
+	return true;
+}
+size_t SampleStream::readCsvRows(Chunk& chunk, size_t rows) {
+	size_t firstRow = rows;
+	while (rows < capacity && textInput) {
+		const char* p = text.data() + textBegin;
+		const char* end = text.data() + textEnd;
+		while (rows < capacity && p < end) {
+			const char* lineEnd = (const char*)memchr(p, '\n', end - p);
+			if (lineEnd == NULL) {
+				// the last line may be unterminated, otherwise wait for the rest of it
+				if (!eof)
+					break;
+				lineEnd = end;
+			}
+			rows += parseCsvRows(p, lineEnd, ',', sampleDims, chunk.inputs.data(), chunk.labels.data(), rows, filename.c_str());
+			p = lineEnd < end ? lineEnd + 1 : end;
+		}
+		textBegin = p - text.data();
+		if (rows == capacity || !fillText())
+			break;
+	}
+	return rows - firstRow;
+}
+bool isGzipFile(const char* filename) {
+	unsigned char magic[2] = { 0, 0 };
+	FILE* f = fopen(filename, "rb");
+	if (f == NULL)
+		return false;
+	size_t n = fread(magic, 1, 2, f);
+	fclose(f);
+	return n == 2 && magic[0] == 0x1f && magic[1] == 0x8b;
+}
+InputStream::InputStream(const char* filename) : filename(filename), file(NULL), gzip(false), gz(NULL), blockPos(0) {
+	gzip = isGzipFile(filename);
+	if (gzip) {
+#ifdef HAVE_ZLIB
+		gz = gzopen(filename, "rb");
+		if (gz != NULL) {
+			gzbuffer((gzFile)gz, 1 << 20);
+			inflateAhead();
+			return;
+		}
+#else
+		std::cout << "FAILURE: " << filename << " is gzip-compressed, but this build has no zlib (HAVE_ZLIB, see ZlibDir in MNIST.vcxproj)" << std::endl;
+		std::exit(1);
+#endif
+	}
+	else
+		file = fopen(filename, "rb");
+	if (file == NULL && gz == NULL) {
+		std::cout << "FAILURE: File path not found: " << filename << std::endl;
+		std::exit(1);
+	}
+}
+InputStream::~InputStream() {
+	if (pending.valid())
+		pending.wait();
+#ifdef HAVE_ZLIB
+	if (gz != NULL)
+		gzclose((gzFile)gz);
+#endif
+	if (file != NULL)
+		fclose(file);
+}
+// starts inflating the block after the current one
+void InputStream::inflateAhead() {
+#ifdef HAVE_ZLIB
+	pending = std::async(std::launch::async, [this]() {
+		ahead.resize(1 << 20);
+		int n = gzread((gzFile)gz, ahead.data(), (unsigned)ahead.size());
+		if (n < 0) {
+			std::cout << "FAILURE: Corrupt gzip data in " + filename + "\n";
+			std::exit(1);
+		}
+		ahead.resize(n);
+	});
+#endif
+}
+size_t InputStream::read(char* buffer, size_t size) {
+	if (!gzip)
+		return fread(buffer, 1, size, file);
+
+	size_t n = 0;
+	while (n < size) {
+		if (blockPos == block.size()) {
+			// the end of the data once an inflated block comes back empty
+			if (!pending.valid())
+				break;
+			pending.get();
+			block.swap(ahead);
+			blockPos = 0;
+			if (block.empty())
+				break;
+			inflateAhead();
+		}
+		size_t m = std::min(size - n, block.size() - blockPos);
+		memcpy(buffer + n, block.data() + blockPos, m);
+		blockPos += m;
+		n += m;
+	}
+	return n;
+}
+void InputStream::rewind() {
+	if (!gzip) {
+		seekFile(file, 0);
+		return;
+	}
+	if (pending.valid())
+		pending.wait();
+#ifdef HAVE_ZLIB
+	gzrewind((gzFile)gz);
+#endif
+	block.clear();
+	blockPos = 0;
+	inflateAhead();
+}
+std::vector<std::string> listShards(const char* pattern) {
+	std::vector<std::string> shards;
+	std::string spec(pattern);
+	if (spec[0] == '@') {
+		std::ifstream manifest(spec.substr(1).c_str());
+		if (manifest.fail()) {
+			std::cout << "FAILURE: File path not found: " << spec.substr(1) << std::endl;
+			std::exit(1);
+		}
+		size_t slash = spec.find_last_of("/\\");
+		std::string dir = slash == std::string::npos ? "" : spec.substr(1, slash);
+		std::string line;
+		while (std::getline(manifest, line)) {
+			line.erase(line.find_last_not_of(" \t\r") + 1);
+			line.erase(0, line.find_first_not_of(" \t"));
+			if (line.empty() || line[0] == '#')
+				continue;
+			bool absolute = line[0] == '/' || line[0] == '\\' || (line.size() > 1 && line[1] == ':');
+			shards.push_back(absolute ? line : dir + line);
+		}
+	}
+	else if (spec.find_first_of("*?") != std::string::npos) {
+#ifdef _WIN32
+		size_t slash = spec.find_last_of("/\\");
+		std::string dir = slash == std::string::npos ? "" : spec.substr(0, slash + 1);
+		WIN32_FIND_DATAA found;
+		HANDLE h = FindFirstFileA(pattern, &found);
+		if (h != INVALID_HANDLE_VALUE) {
+			do {
+				if (!(found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY))
+					shards.push_back(dir + found.cFileName);
+			} while (FindNextFileA(h, &found));
+			FindClose(h);
+		}
+#else
+		glob_t found;
+		if (glob(pattern, 0, NULL, &found) == 0) {
+			for (size_t i = 0; i < found.gl_pathc; i++)
+				shards.push_back(found.gl_pathv[i]);
+			globfree(&found);
+		}
+#endif
+		// the caches written next to the shards match the pattern too
+		std::vector<std::string> sources;
+		for (size_t i = 0; i < shards.size(); i++) {
+			const std::string& name = shards[i];
+			if (name.size() < 8 || name.compare(name.size() - 8, 8, ".mlcache") != 0)
+				if (name.size() < 4 || name.compare(name.size() - 4, 4, ".tmp") != 0)
+					sources.push_back(name);
+		}
+		shards.swap(sources);
+		std::sort(shards.begin(), shards.end());
+	}
+	else
+		shards.push_back(spec);
+	if (shards.empty()) {
+		std::cout << "FAILURE: No data files match " << pattern << std::endl;
+		std::exit(1);
+	}
+	return shards;
+}
+void samplesFromShards(const std::vector<std::string>& shards, DataSet& data, bool useCache) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	struct Shard {
+		int dims;
+		size_t count;
+		bool cached;
+		SampleCacheHeader header;
+		std::shared_ptr<MappedFile> text;
+		const char* first;
+		DataSet loaded;
+	};
+	int n = (int)shards.size();
+	std::vector<Shard> info(n);
+
+	// row counts: from the cache header, by counting lines, or (for compressed shards) by loading them
+	parallelFor(n, [&](int k) {
+		Shard& shard = info[k];
+		const char* name = shards[k].c_str();
+		shard.cached = useCache && validSampleCache(name, shard.header);
+		if (shard.cached) {
+			shard.dims = shard.header.dims;
+			shard.count = (size_t)shard.header.count;
+		}
+		else if (isGzipFile(name)) {
+			samplesFromCompressedCsv(name, shard.loaded);
+			shard.dims = shard.loaded.dims;
+			shard.count = shard.loaded.count;
+		}
+		else {
+			shard.text = std::make_shared<MappedFile>(name);
+			const char* first = (const char*)shard.text->data();
+			const char* end = first + shard.text->size();
+			const char* firstEnd = findLineEnd(first, end);
+			while (first < end && blankLine(first, firstEnd)) {
+				first = firstEnd + 1;
+				firstEnd = first < end ? findLineEnd(first, end) : end;
+			}
+			shard.first = std::min(first, end);
+			shard.dims = first < end ? countCsvFields(first, firstEnd, ',') - 1 : 0;
+			shard.count = countCsvRows(shard.first, end);
+		}
+	});
+
+	int dims = 0;
+	std::vector<size_t> offsets(n + 1, 0);
+	for (int k = 0; k < n; k++) {
+		if (info[k].count > 0 && dims == 0)
+			dims = info[k].dims;
+		if (info[k].count > 0 && info[k].dims != dims) {
+			std::cout << "FAILURE: " << shards[k] << " has " << info[k].dims << " dimensions, expected " << dims << std::endl;
+			std::exit(1);
+		}
+		offsets[k + 1] = offsets[k] + info[k].count;
+	}
+
+	// every shard fills its own range of the combined data set
+	unsigned char* inputs = allocateSamples(data, dims, offsets[n]);
+	unsigned char* labels = inputs + offsets[n] * dims;
+	parallelFor(n, [&](int k) {
+		Shard& shard = info[k];
+		const char* name = shards[k].c_str();
+		unsigned char* shardInputs = inputs + offsets[k] * dims;
+		unsigned char* shardLabels = labels + offsets[k];
+		if (shard.cached) {
+			std::string path = sampleCachePath(name);
+			MappedFile cache(path.c_str());
+			memcpy(shardLabels, cache.data() + sizeof(SampleCacheHeader), shard.count);
+			memcpy(shardInputs, cache.data() + sampleCacheFeatureOffset(shard.header), shard.count * dims);
+			return;
+		}
+		if (shard.text)
+			parseCsvRows(shard.first, (const char*)shard.text->data() + shard.text->size(), ',', dims, inputs, labels, offsets[k], name);
+		else {
+			memcpy(shardLabels, shard.loaded.labelData, shard.count);
+			memcpy(shardInputs, shard.loaded.inputData, shard.count * dims);
+			shard.loaded = DataSet();
+		}
+		if (useCache) {
+			DataSet view;
+			view.dims = dims;
+			view.count = shard.count;
+			view.inputData = shardInputs;
+			view.labelData = shardLabels;
+			writeSampleCache(name, view);
+		}
+	});
+
+	if (verbose) {
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		std::ostringstream msg;
+		msg << "Read " << n << " shards with " << offsets[n] << " samples in " << seconds << " s" << std::endl;
+		std::cout << msg.str();
+	}
+}
+#ifdef _WIN32
+SharedSegment* SharedSegment::open(const std::string& name) {
+	HANDLE mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name.c_str());
+	if (mapping == NULL)
+		return NULL;
+	void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	MEMORY_BASIC_INFORMATION info;
+	if (view == NULL || VirtualQuery(view, &info, sizeof(info)) == 0) {
+		if (view != NULL)
+			UnmapViewOfFile(view);
+		CloseHandle(mapping);
+		return NULL;
+	}
+	SharedSegment* segment = new SharedSegment();
+	segment->ptr = (unsigned char*)view;
+	segment->len = info.RegionSize;
+	segment->mapHandle = mapping;
+	return segment;
+}
+bool SharedSegment::exists(const std::string& name) {
+	// a file mapping has its size from the start, so there is none that open() would miss
+	return false;
+}
+SharedSegment* SharedSegment::create(const std::string& name, size_t size) {
+	HANDLE mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, (DWORD)((uint64_t)size >> 32), (DWORD)size, name.c_str());
+	if (mapping == NULL)
+		return NULL;
+	if (GetLastError() == ERROR_ALREADY_EXISTS) {
+		CloseHandle(mapping);
+		return NULL;
+	}
+	void* view = MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, size);
+	if (view == NULL) {
+		CloseHandle(mapping);
+		return NULL;
+	}
+	SharedSegment* segment = new SharedSegment();
+	segment->ptr = (unsigned char*)view;
+	segment->len = size;
+	segment->mapHandle = mapping;
+	return segment;
+}
+void SharedSegment::unlink(const std::string& name) {
+	// the mapping disappears with its last handle
+}
+SharedSegment::~SharedSegment() {
+	UnmapViewOfFile(ptr);
+	CloseHandle(mapHandle);
+}
+static bool processAlive(int64_t pid) {
+	HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, (DWORD)pid);
+	if (process == NULL)
+		return false;
+	bool alive = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+	CloseHandle(process);
+	return alive;
+}
+static int64_t currentProcess() {
+	return (int64_t)GetCurrentProcessId();
+}
+#else
+SharedSegment* SharedSegment::open(const std::string& name) {
+	int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+	// the lock is held for as long as the segment is mapped; it is only ever exclusive while the
+	// last user unlinks the segment, which is then as good as gone
+	struct stat st;
+	void* view = MAP_FAILED;
+	if (flock(fd, LOCK_SH | LOCK_NB) == 0 && fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(SharedSamplesHeader))
+		view = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (view == MAP_FAILED) {
+		close(fd);
+		return NULL;
+	}
+	SharedSegment* segment = new SharedSegment();
+	segment->ptr = (unsigned char*)view;
+	segment->len = (size_t)st.st_size;
+	segment->fd = fd;
+	segment->name = name;
+	return segment;
+}
+bool SharedSegment::exists(const std::string& name) {
+	int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if (fd < 0)
+		return false;
+	close(fd);
+	return true;
+}
+SharedSegment* SharedSegment::create(const std::string& name, size_t size) {
+	int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd < 0)
+		return NULL;
+	void* view = MAP_FAILED;
+	if (flock(fd, LOCK_SH) == 0 && ftruncate(fd, (off_t)size) == 0)
+		view = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (view == MAP_FAILED) {
+		shm_unlink(name.c_str());
+		close(fd);
+		return NULL;
+	}
+	SharedSegment* segment = new SharedSegment();
+	segment->ptr = (unsigned char*)view;
+	segment->len = size;
+	segment->fd = fd;
+	segment->name = name;
+	return segment;
+}
+void SharedSegment::unlink(const std::string& name) {
+	shm_unlink(name.c_str());
+}
+SharedSegment::~SharedSegment() {
+	munmap(ptr, len);
+	// the last user unlinks the name, unless it has meanwhile been given to a newer segment
+	if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+		int current = shm_open(name.c_str(), O_RDONLY, 0);
+		struct stat mine, named;
+		if (current >= 0 && fstat(fd, &mine) == 0 && fstat(current, &named) == 0 && mine.st_dev == named.st_dev && mine.st_ino == named.st_ino)
+			shm_unlink(name.c_str());
+		if (current >= 0)
+			close(current);
+	}
+	close(fd);
+}
+static bool processAlive(int64_t pid) {
+	return kill((pid_t)pid, 0) == 0 || errno != ESRCH;
+}
+static int64_t currentProcess() {
+	return (int64_t)getpid();
+}
+#endif
+static const char sharedSamplesMagic[8] = { 'M', 'L', 'S', 'H', 'A', 'R', 'E', '1' };
+static size_t sharedSamplesFeatureOffset(uint64_t count) {
+	return (sizeof(SharedSamplesHeader) + (size_t)count + 63) & ~(size_t)63;
+}
+// the segment name depends only on the absolute source paths; their sizes and mtimes are checked on attach
+static std::string sharedSamplesName(const std::vector<std::string>& sources, uint64_t& stamp) {
+	uint64_t h = 14695981039346656037ull;
+	stamp = 14695981039346656037ull;
+	for (size_t i = 0; i < sources.size(); i++) {
+#ifdef _WIN32
+		char path[_MAX_PATH];
+		std::string absolute = _fullpath(path, sources[i].c_str(), _MAX_PATH) ? path : sources[i];
+#else
+		char* path = realpath(sources[i].c_str(), NULL);
+		std::string absolute = path ? path : sources[i];
+		free(path);
+#endif
+		h = (contentHash((const unsigned char*)absolute.data(), absolute.size()) ^ h) * 1099511628211ull;
+		uint64_t size = 0;
+		int64_t mtime = 0;
+		fileStat(sources[i].c_str(), size, mtime);
+		stamp = ((stamp ^ size) * 1099511628211ull ^ (uint64_t)mtime) * 1099511628211ull;
+	}
+	std::ostringstream name;
+#ifdef _WIN32
+	name << "Local\\";
+#else
+	name << "/";
+#endif
+	name << "motionlearn-" << std::hex << h;
+	return name.str();
+}
+// a header-sized segment holding the publisher, created before the data set is loaded (and its
+// size known), so that processes started together wait for one load instead of each doing their own
+static std::string sharedSamplesClaim(const std::string& name) {
+	return name + "-loading";
+}
+// waits for the publisher of an existing segment, from its claim (loading the data set, sizing the
+// segment, then filling it) up to the ready flag; false if there is none, it died, or the segment is stale
+static bool attachSharedSamples(const std::string& name, uint64_t stamp, DataSet& data) {
+	std::string claimName = sharedSamplesClaim(name);
+	std::shared_ptr<SharedSegment> segment;
+	const SharedSamplesHeader* header = NULL;
+	// a segment that has no publisher this long after it appeared was abandoned during its creation
+	std::chrono::steady_clock::time_point giveUp = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	for (bool waited = false; ; waited = true) {
+		segment.reset(SharedSegment::open(name));
+		int64_t publisher = 0;
+		if (segment) {
+			header = (const SharedSamplesHeader*)segment->data();
+			if (memcmp(header->magic, sharedSamplesMagic, 8) == 0 && header->ready)
+				break;
+			publisher = header->publisher;
+		}
+		else if (!SharedSegment::exists(name)) {
+			// not published yet, but it may be being loaded; the claim goes once the segment is ready
+			std::unique_ptr<SharedSegment> claim(SharedSegment::open(claimName));
+			if (claim)
+				publisher = ((const SharedSamplesHeader*)claim->data())->publisher;
+			else if (!SharedSegment::exists(claimName) && !SharedSegment::exists(name))
+				return false;
+		}
+		if (publisher != 0 ? !processAlive(publisher) : std::chrono::steady_clock::now() > giveUp) {
+			SharedSegment::unlink(name);
+			SharedSegment::unlink(claimName);
+			return false;
+		}
+		if (verbose && !waited)
+			std::cout << "Waiting for the publisher of " << name << std::endl;
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	}
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (header->sourceStamp != stamp
+		|| segment->size() < sharedSamplesFeatureOffset(header->count) + header->count * header->dims) {
+		// the segment goes away once its current users are done with it
+		SharedSegment::unlink(name);
+		return false;
+	}
+	data.storage.assign(1, segment);
+	data.dims = header->dims;
+	data.count = (size_t)header->count;
+	data.labelData = segment->data() + sizeof(SharedSamplesHeader);
+	data.inputData = segment->data() + sharedSamplesFeatureOffset(header->count);
+	return true;
+}
+void sharedSamples(const std::vector<std::string>& sources, const std::function<void(DataSet&)>& load, DataSet& data) {
+	uint64_t stamp;
+	std::string name = sharedSamplesName(sources, stamp);
+	if (attachSharedSamples(name, stamp, data))
+		return;
+
+	// claim the name before loading; whoever got there first is loading it already, and if that
+	// copy turns out unusable this process makes a private one
+	std::unique_ptr<SharedSegment> claim(SharedSegment::create(sharedSamplesClaim(name), sizeof(SharedSamplesHeader)));
+	if (!claim) {
+		if (!attachSharedSamples(name, stamp, data))
+			load(data);
+		return;
+	}
+	((SharedSamplesHeader*)claim->data())->publisher = currentProcess();
+
+	load(data);
+	size_t size = sharedSamplesFeatureOffset(data.count) + data.count * data.dims;
+	std::shared_ptr<SharedSegment> segment(SharedSegment::create(name, size));
+	if (!segment) {
+		// another process got there first; its copy replaces ours unless it turns out unusable
+		DataSet shared;
+		if (attachSharedSamples(name, stamp, shared))
+			data = shared;
+		return;
+	}
+	SharedSamplesHeader* header = (SharedSamplesHeader*)segment->data();
+	memcpy(header->magic, sharedSamplesMagic, 8);
+	header->dims = data.dims;
+	header->count = data.count;
+	header->sourceStamp = stamp;
+	header->publisher = currentProcess();
+	memcpy(segment->data() + sizeof(SharedSamplesHeader), data.labelData, data.count);
+	memcpy(segment->data() + sharedSamplesFeatureOffset(data.count), data.inputData, data.count * data.dims);
+	std::atomic_thread_fence(std::memory_order_release);
+	header->ready = 1;
+	// the segment is found from here on; the claim goes with its last user
+	claim.reset();
+
+	// drop the private copy in favour of the published one
+	data.storage.assign(1, segment);
+	data.labelData = segment->data() + sizeof(SharedSamplesHeader);
+	data.inputData = segment->data() + sharedSamplesFeatureOffset(data.count);
+	if (verbose)
+		std::cout << "Published " << data.count << " samples as " << name << std::endl;
+}
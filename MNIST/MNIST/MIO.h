@@ -7,9 +7,221 @@
 #include <sstream>
 #include <stdio.h>
 #include <list>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
 #include "Util.h"
 
+typedef Eigen::Matrix<unsigned char, Eigen::Dynamic, Eigen::Dynamic> MatrixXu8;
+typedef Eigen::Matrix<unsigned char, Eigen::Dynamic, 1> VectorXu8;
+
+// Read-only mapping of a whole file into memory, released on destruction.
+class MappedFile {
+public:
+	explicit MappedFile(const char* filename);
+	~MappedFile();
+	const unsigned char* data() const { return ptr; }
+	size_t size() const { return len; }
+private:
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+	const unsigned char* ptr;
+	size_t len;
+#ifdef _WIN32
+	void* fileHandle;
+	void* mapHandle;
+#else
+	int fd;
+#endif
+};
+
+// Named block of shared memory (POSIX shm_open, a pagefile-backed file mapping on Windows),
+// unmapped on destruction. The segment goes away with the last process that has it mapped: on
+// Windows by itself, on POSIX systems because every user holds a shared lock on it, which the last
+// one to unmap it can take exclusively, and then unlinks the name.
+class SharedSegment {
+public:
+	// maps an existing segment read-only, NULL if there is none (or it is still being sized)
+	static SharedSegment* open(const std::string& name);
+	// whether there is a segment of that name, mapped or still being sized by its creator
+	static bool exists(const std::string& name);
+	// creates and maps a new segment read-write, NULL if the name is taken
+	static SharedSegment* create(const std::string& name, size_t size);
+	static void unlink(const std::string& name);
+	~SharedSegment();
+	unsigned char* data() const { return ptr; }
+	size_t size() const { return len; }
+private:
+	SharedSegment() : ptr(NULL), len(0) {}
+	SharedSegment(const SharedSegment&);
+	SharedSegment& operator=(const SharedSegment&);
+	unsigned char* ptr;
+	size_t len;
+#ifdef _WIN32
+	void* mapHandle;
+#else
+	int fd;
+	std::string name;
+#endif
+};
+
+// Sequential reader over a plain or a gzip-compressed file (told apart by the gzip magic bytes).
+// Compressed input is inflated block by block on a separate thread, one block ahead of the
+// reader, so decompression overlaps with parsing and never goes through a temporary file.
+// gzip input needs zlib: MNIST.vcxproj defines HAVE_ZLIB and links it when it finds it in ZlibDir.
+class InputStream {
+public:
+	explicit InputStream(const char* filename);
+	~InputStream();
+	// returns the number of bytes read, 0 at the end of the (uncompressed) data
+	size_t read(char* buffer, size_t size);
+	void rewind();
+	bool compressed() const { return gzip; }
+private:
+	InputStream(const InputStream&);
+	InputStream& operator=(const InputStream&);
+	void inflateAhead();
+
+	std::string filename;
+	FILE* file;
+	bool gzip;
+	void* gz;
+	std::vector<char> block, ahead;
+	size_t blockPos;
+	std::future<void> pending;
+};
+
+// IDX (ubyte) file as distributed with MNIST: big-endian header, then raw bytes.
+// dims[0] is the number of samples, the remaining dims are the sample shape.
+// Plain files are mapped, gzip-compressed ones are inflated into memory.
+struct IdxFile {
+	std::shared_ptr<const void> storage;
+	std::vector<int> dims;
+	const unsigned char* data;
+};
+
+// Samples are stored as bytes (one sample per column) and only converted to the network's
+// scalar type batch by batch. The bytes live in a heap buffer or in a mapped file; either way
+// storage keeps them alive, and copies of a DataSet share them.
+struct DataSet {
+	DataSet() : inputData(NULL), labelData(NULL), dims(0), count(0) {}
+	Eigen::Map<const MatrixXu8> inputs() const { return Eigen::Map<const MatrixXu8>(inputData, dims, count); }
+	Eigen::Map<const VectorXu8> labels() const { return Eigen::Map<const VectorXu8>(labelData, count); }
+
+	std::vector<std::shared_ptr<const void>> storage;
+	const unsigned char* inputData;
+	const unsigned char* labelData;
+	int dims;
+	size_t count;
+};
+
+// Binary copy of a parsed CSV data set, written next to the source as <source>.mlcache.
+// Followed by count uint8 labels, padding to 8 bytes, then count * dims uint8 features.
+struct SampleCacheHeader {
+	char magic[8];
+	uint32_t featureType; // always 0 (uint8)
+	uint32_t dims;
+	uint64_t count;
+	uint64_t sourceSize;
+	int64_t sourceMtime;
+	uint64_t sourceHash;
+};
+
+// Header of a data set published in shared memory; labels follow it, then the features.
+struct SharedSamplesHeader {
+	char magic[8];
+	// set once the publisher has filled in the samples
+	volatile uint32_t ready;
+	uint32_t dims;
+	uint64_t count;
+	// sizes and modification times of the source files
+	uint64_t sourceStamp;
+	int64_t publisher;
+};
+
+// Reads a (possibly gzip-compressed) CSV data set, or its .mlcache when that is up to date, one
+// chunk of samples at a time, so that only a bounded part of the data set is ever resident. While
+// the caller works on the current chunk, the following one is read ahead on a separate thread.
+// A data set split into several shard files is read shard by shard, in a new random shard order
+// on every pass.
+class SampleStream {
+public:
+	// the chunk size is chosen to fit memoryBudget bytes and is a multiple of chunkMultiple samples
+	SampleStream(const std::vector<std::string>& shards, size_t memoryBudget, int chunkMultiple, bool useCache = true);
+	SampleStream(const char* filename, size_t memoryBudget, int chunkMultiple, bool useCache = true);
+	~SampleStream();
+	// moves to the next chunk; false once the whole data set has been read, the following call starts over
+	bool next();
+	Eigen::Map<const MatrixXu8> inputs() const { return Eigen::Map<const MatrixXu8>(front.inputs.data(), front.inputs.rows(), front.inputs.cols()); }
+	Eigen::Map<const VectorXu8> labels() const { return Eigen::Map<const VectorXu8>(front.labels.data(), front.labels.size()); }
+	int dims() const { return sampleDims; }
+	size_t chunkCapacity() const { return capacity; }
+	size_t shardCount() const { return shards.size(); }
+	// whether the current chunk was read from .mlcache files; before the first next(), whether the
+	// first shard is
+	bool fromCache() const { return front.fromCache; }
+private:
+	struct Chunk {
+		MatrixXu8 inputs;
+		VectorXu8 labels;
+		// set by the thread reading the chunk, as the current shard changes under it
+		bool fromCache;
+	};
+	SampleStream(const SampleStream&);
+	SampleStream& operator=(const SampleStream&);
+	void init(size_t memoryBudget, int chunkMultiple);
+	void restart();
+	void openShard(int index);
+	void readChunk(Chunk& chunk);
+	size_t readBinaryRows(Chunk& chunk, size_t rows);
+	size_t readCsvRows(Chunk& chunk, size_t rows);
+	bool fillText();
+
+	std::vector<std::string> shards;
+	std::vector<int> order;
+	int shardIndex;
+	bool useCache;
+	int sampleDims;
+	size_t capacity;
+	Chunk front, back;
+	std::future<void> pending;
+	// the current shard
+	std::string filename;
+	FILE* file;
+	std::unique_ptr<InputStream> textInput;
+	bool binary;
+	// .mlcache source
+	SampleCacheHeader header;
+	uint64_t nextSample;
+	// CSV source: text[textBegin, textEnd) has been read but not parsed yet
+	std::vector<char> text;
+	size_t textBegin, textEnd;
+	bool eof;
+};
+
 const Eigen::IOFormat CleanFmt(4, 0, ", ", "\n", "[", "]");
-Eigen::MatrixXi matrixFromFile(const char* filename, int skip, char delim = ' ');
+bool isGzipFile(const char* filename);
+// The files of a data set given as a single path, a glob pattern (e.g. "shards/part-*.csv") or
+// a manifest "@list.txt" with one path per line (relative to the manifest's directory).
+std::vector<std::string> listShards(const char* pattern);
+// loads all shards in parallel into one data set, sized up front from a row count of every shard
+void samplesFromShards(const std::vector<std::string>& shards, DataSet& data, bool useCache);
+// Makes one copy of a data set per host: the first process to ask for the given source files runs
+// load() and publishes the result in shared memory, every later one maps that copy read-only. The
+// copy is released with the last process using it.
+void sharedSamples(const std::vector<std::string>& sources, const std::function<void(DataSet&)>& load, DataSet& data);
+// one sample per line, label first, all values in 0..255; samples are written straight into their columns
+void samplesFromCsv(const char* filename, DataSet& data, char delim = ',');
+// false if there is no cache for the source yet or it no longer matches the source; the cache is used in place
+bool samplesFromCache(const char* source, DataSet& data);
+void writeSampleCache(const char* source, const DataSet& data);
 Eigen::VectorXi vectorFromFile(const char* filename, int length, bool lenFromHeader);
-std::ofstream openFile(const char* file, char mode);
\ No newline at end of file
+std::ofstream openFile(const char* file, char mode);
+IdxFile idxFromFile(const char* filename);
+// samples are columns, matching the layout used by the network (no copy is made)
+Eigen::Map<const MatrixXu8> idxImages(const IdxFile& idx);
+Eigen::Map<const VectorXu8> idxLabels(const IdxFile& idx);
+// the data set refers to the mapped files directly
+void samplesFromIdx(const char* imageFile, const char* labelFile, DataSet& data);
\ No newline at end of file
@@ -6,8 +6,16 @@
 #include <string>
 #include <vector>
 #include <iostream>
+#include <future>
+#include <memory>
+#include <chrono>
 
 #include "MIO.h"
+#include "Batches.h"
+#include "Quantize.h"
+#include "Slide.h"
+#include "FixedMlp.h"
+#include "Kernels.h"
 
 using namespace std;
 using namespace Eigen;
@@ -18,70 +26,970 @@ using namespace Eigen;
 static void ShowUsage(void);
 static void CheckOption(char *option, int argc, int minargc);
 
-void ReadData(const char* file, MatrixXd& inputs, VectorXi& labels)
+void ReadData(const char* file, DataSet& data, bool useCache)
 {
-	MatrixXi data = matrixFromFile(file, 0, ',');
-	labels = data.col(0);
-	inputs = data.rightCols(data.cols() - 1).transpose().cast<double>();
+	// a glob or @manifest may name several shards, which are loaded side by side into one data set
+	vector<string> shards = listShards(file);
+	if (shards.size() > 1)
+	{
+		samplesFromShards(shards, data, useCache);
+		return;
+	}
+	file = shards[0].c_str();
+
+	// the binary cache next to the CSV is (re)built whenever it is missing or stale
+	if (useCache && samplesFromCache(file, data))
+		return;
+	samplesFromCsv(file, data, ',');
+	if (useCache)
+		writeSampleCache(file, data);
+}
+
+void ReadSharedData(const char* file, DataSet& data, bool useCache, bool shareData)
+{
+	if (!shareData)
+	{
+		ReadData(file, data, useCache);
+		return;
+	}
+	sharedSamples(listShards(file), [=](DataSet& loaded) { ReadData(file, loaded, useCache); }, data);
+}
+
+void ReadSharedIdx(const char* imageFile, const char* labelFile, DataSet& data, bool shareData)
+{
+	if (!shareData)
+	{
+		samplesFromIdx(imageFile, labelFile, data);
+		return;
+	}
+	vector<string> sources = { imageFile, labelFile };
+	sharedSamples(sources, [=](DataSet& loaded) { samplesFromIdx(imageFile, labelFile, loaded); }, data);
+}
+
+void ForwardLogits(const MatrixXd& inputs, const MatrixXd& inputToHidden, const MatrixXd& hiddenToOutput, MatrixXd& hiddenLayer, MatrixXd& outputLayer)
+{
+	linear_relu<double>(inputToHidden, inputs, NULL, hiddenLayer);
+	gemm<double>(hiddenToOutput, false, hiddenLayer, false, 1.0, outputLayer);
 }
 
 void ForwardProp(const MatrixXd& inputs, const MatrixXd& inputToHidden, const MatrixXd& hiddenToOutput, MatrixXd& hiddenLayer, MatrixXd& outputLayer)
 {
-	hiddenLayer = inputToHidden * inputs;
-	relu(hiddenLayer);
-	outputLayer = hiddenToOutput * hiddenLayer;
-	softmax(outputLayer);
+	ForwardLogits(inputs, inputToHidden, hiddenToOutput, hiddenLayer, outputLayer);
+	softmax<double>(outputLayer);
+}
+
+// prints the cost and accuracy of the -ML network from its logits on the training and test sets
+void PrintEval(const MatrixXd& trainLogits, const VectorXi& trainLabel, const MatrixXd& testLogits, const VectorXi& testLabel)
+{
+	int trainHits = 0, testHits = 0;
+	double trainCost = logits_cross_entropy<double>(trainLogits, trainLabel, &trainHits);
+	double testCost = logits_cross_entropy<double>(testLogits, testLabel, &testHits);
+	cout << "Training Eval: " << trainCost / trainLogits.cols() << endl;
+	cout << "Testing Eval: " << testCost / testLogits.cols() << endl;
+	cout << "Training Accuracy: " << (double)trainHits / trainLogits.cols() << endl;
+	cout << "Testing Accuracy: " << (double)testHits / testLogits.cols() << endl;
 }
 
 void BackProp(const MatrixXd& inputs, const MatrixXd& inputToHidden, const MatrixXd& hiddenToOutput, const MatrixXd& hiddenLayer, const MatrixXd& outputLayer, const VectorXi& labels, MatrixXd& inputToHiddenGrad, MatrixXd& hiddenToOutputGrad)
 {
-	MatrixXd dfdz = crossentropy_softmax_gradient(outputLayer, labels);
-	hiddenToOutputGrad = dfdz * hiddenLayer.transpose()/inputs.cols();
-	MatrixXd dfdy = relu_gradient(hiddenToOutput.transpose() * dfdz, hiddenLayer);
-	inputToHiddenGrad = dfdy * inputs.transpose()/inputs.cols();
+	MatrixXd dfdz(outputLayer.rows(), outputLayer.cols());
+	crossentropy_softmax_gradient<double>(outputLayer, labels, dfdz);
+	gemm<double>(dfdz, false, hiddenLayer, true, (double)inputs.cols(), hiddenToOutputGrad);
+	MatrixXd dfdy;
+	linear_relu_gradient<double>(hiddenToOutput, dfdz, hiddenLayer, dfdy);
+	gemm<double>(dfdy, false, inputs, true, (double)inputs.cols(), inputToHiddenGrad);
 }
 
-void ForwardProp_Adv(const MatrixXd& inputs, const vector<MatrixXd>& weights, vector<MatrixXd>& hiddenLayers, MatrixXd& outputLayer)
+// ReLU activations also kept in sparse form wherever a batch leaves them sparse enough
+// (-sparseActivations): the product with the next weights and both backprop products through
+// those weights then only touch the nonzero activations
+template <typename Scalar>
+struct SparseActivations
 {
-	int n_hid_layers = hiddenLayers.size();
+	explicit SparseActivations(double maxDensity) : maxDensity(maxDensity), sparseCount(0), denseCount(0) {}
 
-	if (n_hid_layers == 0)
+	// decides from the measured density whether hidden layer i of this batch goes sparse
+	bool take(int i, const Ref<const MatrixX<Scalar>>& vals)
+	{
+		if (layers.size() <= (size_t)i)
+		{
+			layers.resize(i + 1);
+			isSparse.resize(i + 1, 0);
+		}
+		isSparse[i] = (vals.array() != Scalar(0)).count() <= maxDensity * vals.size();
+		if (isSparse[i])
+		{
+			layers[i] = vals.sparseView();
+			sparseCount++;
+		}
+		else
+			denseCount++;
+		return isSparse[i] != 0;
+	}
+
+	double maxDensity;
+	vector<SparseMatrix<Scalar>> layers;
+	vector<char> isSparse;
+	// hidden layers that went either way so far, for -v
+	long long sparseCount, denseCount;
+};
+
+// What a Workspace holds buffers for: evaluation only runs the forward pass, training also backprop.
+// Training with the hidden layers saved outside the workspace (-compactActivations, bf16 or half)
+// never holds all of them dense, only the one being computed on and its neighbour.
+enum WorkspaceUse { WORKSPACE_EVAL, WORKSPACE_TRAIN, WORKSPACE_TRAIN_SAVED };
+
+// The buffers of the forward pass of a network, and for training those of backprop, sized once for
+// its layer sizes and the largest batch and carved out of one block: a batch of up to that many
+// samples is held in the leading columns of each, so that a training step makes no allocations, the
+// last, partial batch of a pass included. Every buffer starts on a cache line, so that how the
+// kernels split a buffer into packets does not depend on where the block was allocated.
+template <typename Scalar>
+class Workspace
+{
+public:
+	Workspace(const vector<MatrixX<Scalar>>& weights, int maxBatch, WorkspaceUse use) : use(use), batchCapacity(maxBatch), used(0)
+	{
+		Index widestHidden = 0;
+		for (size_t k = 0; k < weights.size(); k++)
+		{
+			bool isHidden = k + 1 < weights.size();
+			layerSizes.push_back(weights[k].rows());
+			layerStart.push_back(carve(use == WORKSPACE_TRAIN_SAVED && isHidden ? 0 : weights[k].rows() * maxBatch));
+			if (isHidden)
+				widestHidden = max(widestHidden, weights[k].rows());
+			if (use != WORKSPACE_EVAL)
+				weightGrads.push_back(MatrixX<Scalar>(weights[k].rows(), weights[k].cols()));
+		}
+		Index gradientSize = use != WORKSPACE_EVAL ? widestHidden * maxBatch : 0;
+		Index layerSize = use == WORKSPACE_TRAIN_SAVED ? widestHidden * maxBatch : 0;
+		for (int t = 0; t < 2; t++)
+		{
+			gradientStart[t] = carve(gradientSize);
+			layerTurnStart[t] = carve(layerSize);
+		}
+		arena.resize(used + lineScalars);
+	}
+	int hiddenCount() const { return (int)layerSizes.size() - 1; }
+	int maxBatch() const { return batchCapacity; }
+	// the activations of hidden layer i for a batch of cols samples, not with WORKSPACE_TRAIN_SAVED
+	Map<MatrixX<Scalar>> hidden(int i, int cols)
+	{
+		eigen_assert(use != WORKSPACE_TRAIN_SAVED || i == hiddenCount());
+		return buffer(layerStart[i], layerSizes[i], cols);
+	}
+	Map<MatrixX<Scalar>> logits(int cols) { return hidden(hiddenCount(), cols); }
+	// WORKSPACE_TRAIN_SAVED only: hidden layer i while it is computed or backpropagated through,
+	// taking turns in two buffers like the gradients, so that layer i + 1 can be formed from it
+	Map<MatrixX<Scalar>> denseLayer(int i, int cols)
+	{
+		eigen_assert(use == WORKSPACE_TRAIN_SAVED && i < hiddenCount());
+		return buffer(layerTurnStart[i & 1], layerSizes[i], cols);
+	}
+	// training only: the gradient of the cost at the input of the ReLU of hidden layer i, and for
+	// i = hiddenCount() at the logits, which takes their place (see softmax_cross_entropy_gradient);
+	// the hidden layers take turns in two buffers, so that backprop never writes the gradient it reads
+	Map<MatrixX<Scalar>> gradient(int i, int cols)
+	{
+		if (i == hiddenCount())
+			return logits(cols);
+		return buffer(gradientStart[i & 1], layerSizes[i], cols);
+	}
+	// training only: the gradients of the weights, sized like them
+	vector<MatrixX<Scalar>> weightGrads;
+private:
+	enum { lineScalars = 64 / sizeof(Scalar) };
+	// the offset of a new buffer of size scalars
+	Index carve(Index size)
+	{
+		Index start = used;
+		used += (size + lineScalars - 1) / lineScalars * lineScalars;
+		return start;
+	}
+	Map<MatrixX<Scalar>> buffer(Index start, Index rows, int cols)
+	{
+		eigen_assert(cols <= batchCapacity);
+		// the block has a line to spare for skipping to the first line boundary in it
+		Scalar* base = arena.data() + (64 - (size_t)arena.data() % 64) % 64 / sizeof(Scalar);
+		return Map<MatrixX<Scalar>>(base + start, rows, cols);
+	}
+
+	WorkspaceUse use;
+	int batchCapacity;
+	Index used;
+	VectorX<Scalar> arena;
+	vector<Index> layerSizes, layerStart;
+	Index gradientStart[2], layerTurnStart[2];
+};
+
+// the forward pass from the first hidden layer on, up to the logits
+template <typename Scalar>
+void ForwardHidden(const vector<MatrixX<Scalar>>& weights, Workspace<Scalar>& workspace, int cols, SparseActivations<Scalar>* sparse)
+{
+	int n_hid_layers = workspace.hiddenCount();
+
+	for (int i = 0; i < n_hid_layers; i++)
+	{
+		bool last = i == n_hid_layers - 1;
+		Map<MatrixX<Scalar>> hidden = workspace.hidden(i, cols);
+		Map<MatrixX<Scalar>> next = last ? workspace.logits(cols) : workspace.hidden(i + 1, cols);
+		if (sparse != NULL && sparse->take(i, hidden))
+		{
+			next.noalias() = weights[i + 1] * sparse->layers[i];
+			if (!last)
+				relu<Scalar>(next);
+		}
+		else if (!last)
+			linear_relu<Scalar>(weights[i + 1], hidden, NULL, next);
+		else
+			gemm<Scalar>(weights[i + 1], false, hidden, false, Scalar(1), next);
+	}
+}
+
+// backprop from the gradient at the logits down to the first hidden layer, leaving
+// workspace.gradient(0, cols) for the weights of the first layer
+template <typename Scalar>
+void BackPropHidden(const vector<MatrixX<Scalar>>& weights, Workspace<Scalar>& workspace, int cols, SparseActivations<Scalar>* sparse)
+{
+	for (int i = workspace.hiddenCount() - 1; i >= 0; i--)
+	{
+		Map<MatrixX<Scalar>> dfdl = workspace.gradient(i + 1, cols), dfdh = workspace.gradient(i, cols);
+		MatrixX<Scalar>& weightGrad = workspace.weightGrads[i + 1];
+		if (sparse != NULL && sparse->isSparse[i])
+		{
+			weightGrad.noalias() = dfdl * sparse->layers[i].transpose();
+			weightGrad /= Scalar(cols);
+			sparse_linear_relu_gradient<Scalar>(weights[i + 1], dfdl, sparse->layers[i], dfdh);
+		}
+		else
+		{
+			Map<MatrixX<Scalar>> hidden = workspace.hidden(i, cols);
+			gemm<Scalar>(dfdl, false, hidden, true, Scalar(cols), weightGrad);
+			linear_relu_gradient<Scalar>(weights[i + 1], dfdl, hidden, dfdh);
+		}
+	}
+}
+
+// the forward pass up to the logits of the output layer, workspace.logits(inputs.cols())
+template <typename Scalar>
+void ForwardLogits_Adv(const Ref<const MatrixX<Scalar>>& inputs, const vector<MatrixX<Scalar>>& weights, Workspace<Scalar>& workspace, SparseActivations<Scalar>* sparse = NULL)
+{
+	int cols = inputs.cols();
+
+	if (workspace.hiddenCount() == 0)
+	{
+		gemm<Scalar>(weights[0], false, inputs, false, Scalar(1), workspace.logits(cols));
+	}
+	else
+	{
+		linear_relu<Scalar>(weights[0], inputs, NULL, workspace.hidden(0, cols));
+		ForwardHidden(weights, workspace, cols, sparse);
+	}
+}
+
+// the same up to the class probabilities, in place of the logits
+template <typename Scalar>
+void ForwardProp_Adv(const Ref<const MatrixX<Scalar>>& inputs, const vector<MatrixX<Scalar>>& weights, Workspace<Scalar>& workspace)
+{
+	ForwardLogits_Adv<Scalar>(inputs, weights, workspace);
+	softmax<Scalar>(workspace.logits(inputs.cols()));
+}
+
+// the logits of the workspace hold the gradient of the cost at them (see softmax_cross_entropy_gradient);
+// it is used up, and the gradients of the weights are left in workspace.weightGrads
+template <typename Scalar>
+void BackProp_Adv(const Ref<const MatrixX<Scalar>>& inputs, const vector<MatrixX<Scalar>>& weights, Workspace<Scalar>& workspace, SparseActivations<Scalar>* sparse = NULL)
+{
+	int cols = inputs.cols();
+	BackPropHidden(weights, workspace, cols, sparse);
+	gemm<Scalar>(workspace.gradient(0, cols), false, inputs, true, Scalar(cols), workspace.weightGrads[0]);
+}
+
+// the same for a sparse batch (see gatherSparseBatch): the first layer only touches nonzero inputs
+template <typename Scalar>
+void ForwardLogits_Sparse(const SparseMatrix<Scalar>& inputs, const vector<MatrixX<Scalar>>& weights, Workspace<Scalar>& workspace, SparseActivations<Scalar>* sparse = NULL)
+{
+	int cols = inputs.cols();
+
+	if (workspace.hiddenCount() == 0)
 	{
-		outputLayer = weights[0] * inputs;
-		softmax(outputLayer);
+		workspace.logits(cols).noalias() = weights[0] * inputs;
 	}
 	else
 	{
-		hiddenLayers[0] = weights[0] * inputs;
-		relu(hiddenLayers[0]);
-		for (int i = 0; i < n_hid_layers - 1; i++)
+		Map<MatrixX<Scalar>> hidden = workspace.hidden(0, cols);
+		hidden.noalias() = weights[0] * inputs;
+		relu<Scalar>(hidden);
+		ForwardHidden(weights, workspace, cols, sparse);
+	}
+}
+
+// weightGrads[0] is only written in the columns of activeFeatures (the inputs nonzero in the batch),
+// which are all that the update needs, see TrainEpoch
+template <typename Scalar>
+void BackProp_Sparse(const SparseMatrix<Scalar>& inputs, const vector<int>& activeFeatures, const vector<MatrixX<Scalar>>& weights, Workspace<Scalar>& workspace, SparseActivations<Scalar>* sparse = NULL)
+{
+	int cols = inputs.cols();
+	BackPropHidden(weights, workspace, cols, sparse);
+	Map<MatrixX<Scalar>> dfdl = workspace.gradient(0, cols);
+	dfdl /= Scalar(cols);
+	MatrixX<Scalar>& weightGrad = workspace.weightGrads[0];
+	for (size_t k = 0; k < activeFeatures.size(); k++)
+		weightGrad.col(activeFeatures[k]).setZero();
+	for (int j = 0; j < inputs.outerSize(); j++)
+		for (typename SparseMatrix<Scalar>::InnerIterator it(inputs, j); it; ++it)
+			weightGrad.col(it.row()) += it.value() * dfdl.col(j);
+}
+
+// the same, keeping the hidden layers only in compact form for BackProp_Compact
+template <typename Scalar>
+void ForwardLogits_Compact(const Ref<const MatrixX<Scalar>>& inputs, const vector<MatrixX<Scalar>>& weights, vector<CompactActivations>& saved, Workspace<Scalar>& workspace)
+{
+	int n_hid_layers = saved.size();
+
+	if (n_hid_layers == 0)
+	{
+		gemm<Scalar>(weights[0], false, inputs, false, Scalar(1), workspace.logits(inputs.cols()));
+		return;
+	}
+	// only the layer being computed and the one before it are ever dense
+	int cols = inputs.cols();
+	linear_relu<Scalar>(weights[0], inputs, NULL, workspace.denseLayer(0, cols));
+	for (int i = 0; i < n_hid_layers - 1; i++)
+	{
+		Map<MatrixX<Scalar>> hidden = workspace.denseLayer(i, cols);
+		linear_relu<Scalar>(weights[i + 1], hidden, NULL, workspace.denseLayer(i + 1, cols));
+		saved[i].store<Scalar>(hidden);
+	}
+	Map<MatrixX<Scalar>> last = workspace.denseLayer(n_hid_layers - 1, cols);
+	gemm<Scalar>(weights[n_hid_layers], false, last, false, Scalar(1), workspace.logits(cols));
+	saved[n_hid_layers - 1].store<Scalar>(last);
+}
+
+template <typename Scalar>
+void BackProp_Compact(const Ref<const MatrixX<Scalar>>& inputs, const vector<MatrixX<Scalar>>& weights, const vector<CompactActivations>& saved, Workspace<Scalar>& workspace)
+{
+	int cols = inputs.cols();
+	for (int i = saved.size() - 1; i >= 0; i--)
+	{
+		Map<MatrixX<Scalar>> dfdl = workspace.gradient(i + 1, cols), dfdh = workspace.gradient(i, cols);
+		Map<MatrixX<Scalar>> hidden = workspace.denseLayer(i, cols);
+		saved[i].expand<Scalar>(hidden);
+		gemm<Scalar>(dfdl, false, hidden, true, Scalar(cols), workspace.weightGrads[i + 1]);
+		gemm<Scalar>(weights[i + 1], true, dfdl, false, Scalar(1), dfdh);
+		saved[i].maskGradient<Scalar>(dfdh);
+	}
+	gemm<Scalar>(workspace.gradient(0, cols), false, inputs, true, Scalar(cols), workspace.weightGrads[0]);
+}
+
+// -precision bf16|half: the weights are kept in a 16-bit format and widened to float a panel at a time
+// inside each GEMM (gemm_16). Updates go to an fp32 master copy, or, with stochastic rounding, straight
+// to the 16-bit weights.
+template <typename Scalar>
+struct MixedWeights
+{
+	StorageFormat format;
+	bool stochastic;
+	vector<MatrixX<Scalar>> master;
+	vector<MatrixX16> stored;
+	std::mt19937 rng;
+
+	MixedWeights(StorageFormat format, bool stochastic) : format(format), stochastic(stochastic), rng(54321) {}
+	void init(const vector<MatrixX<Scalar>>& weights)
+	{
+		stored.resize(weights.size());
+		for (size_t k = 0; k < weights.size(); k++)
+			pack_16<Scalar>(weights[k], stored[k], format);
+		if (!stochastic)
+			master = weights;
+	}
+	void widen(int k, MatrixX<Scalar>& weight) const
+	{
+		unpack_16(stored[k], weight, format);
+	}
+	void update(const vector<MatrixX<Scalar>>& weightGrads, Scalar rate)
+	{
+		for (size_t k = 0; k < stored.size(); k++)
 		{
-			hiddenLayers[i + 1] = weights[i + 1] * hiddenLayers[i];
-			relu(hiddenLayers[i + 1]);
+			if (stochastic)
+				sgd_update_16(stored[k], weightGrads[k], rate, format, rng);
+			else
+			{
+				master[k] -= rate * weightGrads[k];
+				pack_16<Scalar>(master[k], stored[k], format);
+			}
 		}
-		outputLayer = weights[n_hid_layers] * hiddenLayers[n_hid_layers - 1];
-		softmax(outputLayer);
+	}
+};
+
+// the forward pass with 16-bit weights, keeping the hidden layers for BackProp_Mixed in the same format
+// in the leading columns of saved
+template <typename Scalar>
+void ForwardLogits_Mixed(const Ref<const MatrixX<Scalar>>& inputs, const MixedWeights<Scalar>& weights, vector<MatrixX16>& saved, Workspace<Scalar>& workspace)
+{
+	int n_hid_layers = saved.size(), cols = inputs.cols();
+	if (n_hid_layers == 0)
+	{
+		gemm_16<Scalar>(weights.stored[0], false, weights.format, inputs, false, workspace.logits(cols));
+		return;
+	}
+	gemm_16<Scalar>(weights.stored[0], false, weights.format, inputs, true, workspace.denseLayer(0, cols));
+	for (int i = 0; i < n_hid_layers; i++)
+	{
+		// the next layer sees the activations as they are stored
+		Map<MatrixX<Scalar>> hidden = workspace.denseLayer(i, cols);
+		pack_16<Scalar>(hidden, saved[i].leftCols(cols), weights.format);
+		unpack_16<Scalar>(saved[i].leftCols(cols), hidden, weights.format);
+		if (i < n_hid_layers - 1)
+			gemm_16<Scalar>(weights.stored[i + 1], false, weights.format, hidden, true, workspace.denseLayer(i + 1, cols));
+		else
+			gemm_16<Scalar>(weights.stored[i + 1], false, weights.format, hidden, false, workspace.logits(cols));
 	}
 }
 
-void BackProp_Adv(const MatrixXd& inputs, const vector<MatrixXd>& weights, const vector<MatrixXd>& hiddenLayers, const MatrixXd& outputLayer, const VectorXi& labels, vector<MatrixXd>& weightGrads)
+template <typename Scalar>
+void BackProp_Mixed(const Ref<const MatrixX<Scalar>>& inputs, const MixedWeights<Scalar>& weights, const vector<MatrixX16>& saved, Workspace<Scalar>& workspace)
 {
-	MatrixXd dfdl = crossentropy_softmax_gradient(outputLayer, labels);
-	for (int i = hiddenLayers.size() - 1; i >= 0; i--)
+	int cols = inputs.cols();
+	for (int i = saved.size() - 1; i >= 0; i--)
 	{
-		weightGrads[i + 1] = dfdl * hiddenLayers[i].transpose() / inputs.cols();
-		dfdl = relu_gradient(weights[i + 1].transpose() * dfdl, hiddenLayers[i]);
+		Map<MatrixX<Scalar>> dfdl = workspace.gradient(i + 1, cols), dfdh = workspace.gradient(i, cols);
+		Map<MatrixX<Scalar>> hidden = workspace.denseLayer(i, cols);
+		unpack_16<Scalar>(saved[i].leftCols(cols), hidden, weights.format);
+		gemm<Scalar>(dfdl, false, hidden, true, Scalar(cols), workspace.weightGrads[i + 1]);
+		gemm_16<Scalar>(weights.stored[i + 1], true, weights.format, dfdl, false, dfdh);
+		relu_gradient<Scalar>(dfdh, hidden);
 	}
-	weightGrads[0] = dfdl * inputs.transpose() / inputs.cols();
+	gemm<Scalar>(workspace.gradient(0, cols), false, inputs, true, Scalar(cols), workspace.weightGrads[0]);
 }
 
-double CostEval(const MatrixXd& probs, const VectorXi& labels)
+// the -ML_adv options, filled in as main parses the command line
+struct TrainOptions
+{
+	TrainOptions() : numHiddenLayers(1), nHiddens(1, 100), nClasses(10), batchSize(0), trainStreamFile(NULL), streamBudget(0), useCache(true),
+		prefetchDepth(2), augmentShift(0), compactActivations(false), storage(STORAGE_NATIVE), stochasticRounding(false),
+		int8Calibration(0), fixedTopology(false), sparseDensity(0), activationDensity(0), slideBits(0), slideTables(0), slideRebuild(0) {}
+
+	int numHiddenLayers;
+	vector<int> nHiddens;
+	int nClasses;
+	int batchSize; // 0 means the whole training set
+	const char* trainStreamFile; // -stream: the training set read in chunks, instead of loaded
+	size_t streamBudget; // bytes, 0 means the training set is loaded into memory
+	bool useCache;
+	int prefetchDepth;
+	int augmentShift;
+	bool compactActivations;
+	StorageFormat storage;
+	bool stochasticRounding;
+	int int8Calibration; // calibration samples for -int8, 0 for none
+	bool fixedTopology;
+	double sparseDensity;
+	double activationDensity;
+	int slideBits, slideTables, slideRebuild;
+};
+
+// what a run of -ML_adv trains with besides the dense kernels, set up by RunML_Adv from the options;
+// each is NULL where it is not used
+template <typename Scalar>
+struct TrainModes
+{
+	unique_ptr<MixedWeights<Scalar>> mixed;
+	unique_ptr<SparseSamples> sparseInputs;
+	unique_ptr<SparseActivations<Scalar>> sparseActivations;
+	unique_ptr<SlideTraining<Scalar>> slide;
+};
+
+// a data set being read on its own thread while the remaining options are parsed
+struct PendingLoad
+{
+	future<void> done;
+	const char* name;
+	const DataSet* data;
+};
+
+void WaitForData(vector<PendingLoad>& pending)
+{
+	for (size_t i = 0; i < pending.size(); i++)
+	{
+		pending[i].done.get();
+		cout << "Read in " << pending[i].name << " data with " << pending[i].data->count << " samples, each with " << pending[i].data->dims << " dimensions." << endl;
+	}
+	pending.clear();
+}
+
+template <typename Scalar>
+double CostEval(const MatrixX<Scalar>& probs, const VectorXi& labels)
 {
 	return cross_entropy_discrete(probs, labels);
 }
 
+// One pass of mini-batch gradient descent with step size rate over the given samples, in random
+// batch order, in the buffers of workspace (WORKSPACE_TRAIN_SAVED for compactActivations and mixed,
+// WORKSPACE_TRAIN otherwise). With compactActivations the hidden layers are saved for backprop in a
+// fraction of the memory. With mixed (-precision bf16|half) the training runs on the 16-bit weights
+// and weights receives their widened values at the end, as it receives those of slide (-slide),
+// which trains on its own. Given the samples as sparseInputs, the batches with at most sparseDensity
+// nonzero inputs run the first layer on those alone (-sparseInputs), and with sparseActivations the
+// sparse hidden layers do the same for the following ones.
+template <typename Scalar>
+void TrainEpoch(BatchPipeline<Scalar>& pipeline, const Map<const MatrixXu8>& inputs, const Map<const VectorXu8>& labels, const TrainOptions& options, TrainModes<Scalar>& modes, Scalar rate, vector<MatrixX<Scalar>>& weights, Workspace<Scalar>& workspace)
+{
+	MixedWeights<Scalar>* mixed = modes.mixed.get();
+	SparseActivations<Scalar>* sparseActivations = modes.sparseActivations.get();
+	SlideTraining<Scalar>* slide = modes.slide.get();
+	vector<CompactActivations> saved(options.compactActivations ? workspace.hiddenCount() : 0);
+	// sized for the largest batch once, a batch taking its leading columns
+	vector<MatrixX16> saved16(mixed != NULL ? workspace.hiddenCount() : 0);
+	for (size_t i = 0; i < saved16.size(); i++)
+		saved16[i].resize(weights[i].rows(), workspace.maxBatch());
+	const vector<MatrixX<Scalar>>& weightGrads = workspace.weightGrads;
+	// the pipeline gathers the following batches while this one is trained on
+	pipeline.start(inputs, labels, options.batchSize, true, modes.sparseInputs.get(), options.sparseDensity);
+	while (const Batch<Scalar>* batch = pipeline.next())
+	{
+		if (slide != NULL)
+		{
+			slide->train(batch->inputs(), batch->labels(), rate);
+			continue;
+		}
+		Map<MatrixX<Scalar>> logits = workspace.logits(batch->size);
+		// the output layer goes straight from logits to the gradient at the logits
+		if (mixed != NULL)
+		{
+			ForwardLogits_Mixed<Scalar>(batch->inputs(), *mixed, saved16, workspace);
+			softmax_cross_entropy_gradient<Scalar>(logits, batch->labels(), NULL);
+			BackProp_Mixed<Scalar>(batch->inputs(), *mixed, saved16, workspace);
+			mixed->update(weightGrads, rate);
+			continue;
+		}
+		if (options.compactActivations)
+		{
+			ForwardLogits_Compact<Scalar>(batch->inputs(), weights, saved, workspace);
+			softmax_cross_entropy_gradient<Scalar>(logits, batch->labels(), NULL);
+			BackProp_Compact<Scalar>(batch->inputs(), weights, saved, workspace);
+		}
+		else if (batch->sparse)
+		{
+			ForwardLogits_Sparse(batch->sparseInputs, weights, workspace, sparseActivations);
+			softmax_cross_entropy_gradient<Scalar>(logits, batch->labels(), NULL);
+			BackProp_Sparse(batch->sparseInputs, batch->activeFeatures, weights, workspace, sparseActivations);
+			// the weights of inputs that are zero throughout the batch have no gradient
+			for (size_t k = 0; k < batch->activeFeatures.size(); k++)
+				weights[0].col(batch->activeFeatures[k]) -= rate * weightGrads[0].col(batch->activeFeatures[k]);
+			for (size_t k = 1; k < weights.size(); k++)
+				weights[k] -= rate * weightGrads[k];
+			continue;
+		}
+		else
+		{
+			ForwardLogits_Adv<Scalar>(batch->inputs(), weights, workspace, sparseActivations);
+			softmax_cross_entropy_gradient<Scalar>(logits, batch->labels(), NULL);
+			BackProp_Adv<Scalar>(batch->inputs(), weights, workspace, sparseActivations);
+		}
+		for (size_t k = 0; k < weights.size(); k++)
+			weights[k] -= rate * weightGrads[k];
+	}
+	if (mixed != NULL)
+		for (size_t k = 0; k < weights.size(); k++)
+			mixed->widen(k, weights[k]);
+	if (slide != NULL)
+		slide->copyWeights(weights);
+}
+
+// the number of threads EvalBatches shares the batches among, up to one per core
+inline int EvalWorkers(size_t count, int batchSize)
+{
+	int nBatches = (int)((count + batchSize - 1) / batchSize);
+	return min<int>(nBatches, max(1u, thread::hardware_concurrency()));
+}
+
+// cost and accuracy per sample over count samples, batchSize samples at a time: evalBatch(worker,
+// start, size, &hits) returns the summed cost of one batch and adds its correctly classified samples
+// to hits, worker being below EvalWorkers(count, batchSize) and used by one thread at a time. The
+// batch sums are added up in batch order, so the result does not depend on the number of threads.
+template <typename EvalBatch>
+void EvalBatches(size_t count, int batchSize, const EvalBatch& evalBatch, double& cost, double& acc)
+{
+	int nBatches = (int)((count + batchSize - 1) / batchSize);
+	vector<double> batchCost(nBatches);
+	vector<int> batchHits(nBatches, 0);
+	atomic<int> nextBatch(0);
+	parallelFor(EvalWorkers(count, batchSize), [&](int w) {
+		for (int b = nextBatch++; b < nBatches; b = nextBatch++)
+		{
+			int startIndex = b * batchSize;
+			int actualSize = (int)min<size_t>(batchSize, count - startIndex);
+			batchCost[b] = evalBatch(w, startIndex, actualSize, &batchHits[b]);
+		}
+	});
+	double costSum = 0;
+	int hits = 0;
+	for (int b = 0; b < nBatches; b++)
+	{
+		costSum += batchCost[b];
+		hits += batchHits[b];
+	}
+	cost = costSum / count;
+	acc = (double)hits / count;
+}
+
+// cost and accuracy over the given samples, see EvalBatches; every worker has its own buffers,
+// workspace serving the first
+template <typename Scalar>
+void EvalData(const Ref<const MatrixXu8>& inputs, const Ref<const VectorXu8>& labels, int batchSize, const vector<MatrixX<Scalar>>& weights, Workspace<Scalar>& workspace, double& cost, double& acc)
+{
+	int nWorkers = EvalWorkers(inputs.cols(), batchSize);
+	vector<Workspace<Scalar>> workerSpaces;
+	for (int w = 1; w < nWorkers; w++)
+		workerSpaces.push_back(Workspace<Scalar>(weights, batchSize, WORKSPACE_EVAL));
+	vector<Batch<Scalar>> batches(nWorkers);
+	EvalBatches(inputs.cols(), batchSize, [&](int w, int startIndex, int size, int* hits) {
+		Workspace<Scalar>& space = w == 0 ? workspace : workerSpaces[w - 1];
+		gatherBatch(inputs, labels, startIndex, size, batches[w]);
+		// straight from the logits to the cost and the hits, without forming probabilities
+		ForwardLogits_Adv<Scalar>(batches[w].inputs(), weights, space);
+		return logits_cross_entropy<Scalar>(space.logits(size), batches[w].labels(), hits);
+	}, cost, acc);
+}
+
+// the same over a data set streamed from disk; an empty stream counts as cost and accuracy 0
+template <typename Scalar>
+void EvalStream(SampleStream& stream, int batchSize, const vector<MatrixX<Scalar>>& weights, Workspace<Scalar>& workspace, double& cost, double& acc)
+{
+	double costSum = 0, hitSum = 0;
+	size_t count = 0;
+	while (stream.next())
+	{
+		double chunkCost, chunkAcc;
+		EvalData(stream.inputs(), stream.labels(), batchSize, weights, workspace, chunkCost, chunkAcc);
+		costSum += chunkCost * stream.inputs().cols();
+		hitSum += chunkAcc * stream.inputs().cols();
+		count += stream.inputs().cols();
+	}
+	cost = count > 0 ? costSum / count : 0;
+	acc = count > 0 ? hitSum / count : 0;
+}
+
+// prints the network output for the first 5 samples
+template <typename Scalar>
+void PrintFirstSamples(const Ref<const MatrixXu8>& inputs, const Ref<const VectorXu8>& labels, const vector<MatrixX<Scalar>>& weights)
+{
+	Batch<Scalar> batch;
+	int n = min<int>(5, inputs.cols());
+	Workspace<Scalar> workspace(weights, n, WORKSPACE_EVAL);
+	gatherBatch(inputs, labels, 0, n, batch);
+	ForwardProp_Adv<Scalar>(batch.inputs(), weights, workspace);
+	Map<MatrixX<Scalar>> probs = workspace.logits(n);
+	for (int j = 0; j < n; j++)
+		cout << probs.col(j).transpose() << " Ground Truth: " << batch.labels()(j) << endl;
+}
+
 bool verbose = false;
 
+// quantizes the trained network to int8, calibrated on the given samples, and compares it with the
+// trained network on the test set
+template <typename Scalar>
+void CompareInt8(const vector<MatrixX<Scalar>>& weights, const Ref<const MatrixXu8>& calibration, const DataSet& testSet, int batchSize, Workspace<Scalar>& workspace)
+{
+	vector<MatrixXf> floatWeights;
+	for (size_t k = 0; k < weights.size(); k++)
+		floatWeights.push_back(weights[k].template cast<float>());
+	QuantizedNetwork quantized(floatWeights, calibration);
+
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	double cost, acc;
+	EvalData(testSet.inputs(), testSet.labels(), batchSize, weights, workspace, cost, acc);
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	// the same batches on the same workers as EvalData, so that the throughputs compare
+	start = chrono::steady_clock::now();
+	int nWorkers = EvalWorkers(testSet.count, batchSize);
+	vector<MatrixXf> logits(nWorkers);
+	vector<VectorXi> labels(nWorkers);
+	double int8Cost, int8Acc;
+	EvalBatches(testSet.count, batchSize, [&](int w, int startIndex, int size, int* hits) {
+		quantized.forward(testSet.inputs().middleCols(startIndex, size), logits[w]);
+		labels[w] = testSet.labels().segment(startIndex, size).cast<int>();
+		return logits_cross_entropy<float>(logits[w], labels[w], hits);
+	}, int8Cost, int8Acc);
+	double int8Seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	cout << endl << "Int8 network (" << QuantizedNetwork::kernelName() << " kernel, calibrated on " << calibration.cols() << " samples):" << endl;
+	cout << "Testing Eval: " << int8Cost << " (trained: " << cost << ")" << endl;
+	cout << "Testing Accuracy: " << int8Acc << " (trained: " << acc << ", delta " << int8Acc - acc << ")" << endl;
+	cout << "Throughput: " << testSet.count / int8Seconds << " samples/s (trained: " << testSet.count / seconds << " samples/s)" << endl;
+}
+
+// runs the test set through the network compiled in for the trained topology (see FixedMlp.h) and
+// compares it with the dynamic network taking the samples one at a time as well, which is all there
+// is when the topology is not compiled in
+template <typename Scalar>
+void CompareFixed(const vector<MatrixX<Scalar>>& weights, const DataSet& testSet, Workspace<Scalar>& workspace)
+{
+	VectorXi labels = testSet.labels().cast<int>();
+	MatrixX<Scalar> dynamicProbs(weights.back().rows(), testSet.count), input;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	for (int j = 0; j < (int)testSet.count; j++)
+	{
+		input = testSet.inputs().col(j).cast<Scalar>();
+		ForwardProp_Adv<Scalar>(input, weights, workspace);
+		dynamicProbs.col(j) = workspace.logits(1);
+	}
+	double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	unique_ptr<FixedNetwork<Scalar>> fixed = makeFixedNetwork(weights);
+	if (!fixed)
+	{
+		cout << endl << "No compile-time network for this topology (see FixedMlp.cpp), one sample at a time on the dynamic network:" << endl;
+		cout << "Testing Accuracy: " << accuracy(dynamicProbs, labels) << endl;
+		cout << "Throughput: " << testSet.count / seconds << " samples/s" << endl;
+		return;
+	}
+	start = chrono::steady_clock::now();
+	MatrixX<Scalar> probs;
+	fixed->forward(testSet.inputs(), probs);
+	double fixedSeconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	cout << endl << "Compile-time network " << fixed->topology() << ", one sample at a time:" << endl;
+	cout << "Testing Accuracy: " << accuracy(probs, labels) << " (dynamic: " << accuracy(dynamicProbs, labels) << ", largest difference in a probability " << (probs - dynamicProbs).cwiseAbs().maxCoeff() << ")" << endl;
+	cout << "Throughput: " << testSet.count / fixedSeconds << " samples/s (dynamic: " << testSet.count / seconds << " samples/s)" << endl;
+}
+
+// initial weights, drawn in double so that both precisions start from the same network
+template <typename Scalar>
+MatrixX<Scalar> RandomWeights(int rows, int cols)
+{
+	return (MatrixXd::Random(rows, cols) * 0.1).cast<Scalar>();
+}
+
+// -benchGemm: times every matrix product kernel (see GemmKernel in Kernels.h) on the products of
+// training and inference of the network, for one sample, 8 and a batch
+template <typename Scalar>
+void BenchGemm(const vector<int>& layerSizes, int batchSize)
+{
+	cout << "GFLOP/s of the " << isaName(currentKernels().compiledFor) << " kernels (- where a kernel does not apply)" << endl;
+	cout << "product m x n x k";
+	for (int kernel = 0; kernel < GEMM_KERNEL_COUNT; kernel++)
+		cout << " | " << gemmKernelName((GemmKernel)kernel);
+	cout << endl;
+	const KernelTable<Scalar>& table = kernels<Scalar>();
+	streamsize precision = cout.precision(3);
+	int batches[3] = { 1, 8, batchSize };
+	for (int b = 0; b < 3; b++)
+	{
+		if (b > 0 && batches[b] <= batches[b - 1])
+			continue;
+		int n = batches[b];
+		for (size_t l = 0; l + 1 < layerSizes.size(); l++)
+		{
+			int in = layerSizes[l], out = layerSizes[l + 1];
+			MatrixX<Scalar> w = RandomWeights<Scalar>(out, in), x = RandomWeights<Scalar>(in, n), g = RandomWeights<Scalar>(out, n);
+			// forward, weight gradient and (above the first layer) backward through the weights
+			struct Product { const char* name; int m, n, k; const Scalar* a; bool transA; const Scalar* b; bool transB; };
+			Product products[3] = {
+				{ "forward", out, n, in, w.data(), false, x.data(), false },
+				{ "weight gradient", out, in, n, g.data(), false, x.data(), true },
+				{ "backward", in, n, out, w.data(), true, g.data(), false } };
+			for (int p = 0; p < (l == 0 ? 2 : 3); p++)
+			{
+				const Product& pr = products[p];
+				MatrixX<Scalar> reference(pr.m, pr.n), c(pr.m, pr.n);
+				table.gemmWith(GEMM_EIGEN, pr.m, pr.n, pr.k, pr.a, pr.transA, pr.b, pr.transB, Scalar(1), reference.data());
+				cout << "layer " << l << " " << pr.name << " " << pr.m << " x " << pr.n << " x " << pr.k;
+				for (int kernel = 0; kernel < GEMM_KERNEL_COUNT; kernel++)
+				{
+					if (!table.gemmWith((GemmKernel)kernel, pr.m, pr.n, pr.k, pr.a, pr.transA, pr.b, pr.transB, Scalar(1), c.data()))
+					{
+						cout << " | -";
+						continue;
+					}
+					// the best of 5 runs of at least 10 ms each
+					double best = 0;
+					for (int run = 0; run < 5; run++)
+					{
+						int reps = 0;
+						double seconds = 0;
+						chrono::steady_clock::time_point start = chrono::steady_clock::now();
+						do
+						{
+							table.gemmWith((GemmKernel)kernel, pr.m, pr.n, pr.k, pr.a, pr.transA, pr.b, pr.transB, Scalar(1), c.data());
+							reps++;
+							seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+						} while (seconds < 0.01);
+						best = max(best, 2.0 * pr.m * pr.n * pr.k * reps / seconds * 1e-9);
+					}
+					cout << " | " << best;
+					if (!c.isApprox(reference, sizeof(Scalar) == 4 ? 1e-4 : 1e-10))
+						cout << " (wrong result)";
+				}
+				cout << endl;
+			}
+		}
+	}
+	cout.precision(precision);
+}
+
+// -ML_adv: mini-batch training of a network with any number of hidden layers, in the given precision;
+// options is a copy, as the batch size and the sparse densities are settled here
+template <typename Scalar>
+void RunML_Adv(int n_iter, TrainOptions options, const DataSet& trainSet, const DataSet& testSet)
+{
+	if (verbose)
+		cout << "Running the " << isaName(currentKernels().compiledFor) << " kernels" << endl;
+
+	// set up the network
+	const vector<int>& nHiddens = options.nHiddens;
+	int numHiddenLayers = options.numHiddenLayers;
+	vector<MatrixX<Scalar>> weights;
+	if (numHiddenLayers == 0)
+	{
+		weights.push_back(RandomWeights<Scalar>(options.nClasses, 784));
+	}
+	else
+	{
+		weights.push_back(RandomWeights<Scalar>(nHiddens[0], 784));
+		for (int i = 0; i < numHiddenLayers - 1; i++)
+			weights.push_back(RandomWeights<Scalar>(nHiddens[i + 1], nHiddens[i]));
+		weights.push_back(RandomWeights<Scalar>(options.nClasses, nHiddens[numHiddenLayers - 1]));
+	}
+	// with 16-bit weights the network is evaluated as it is stored
+	TrainModes<Scalar> modes;
+	if (options.storage != STORAGE_NATIVE)
+	{
+		modes.mixed.reset(new MixedWeights<Scalar>(options.storage, options.stochasticRounding));
+		modes.mixed->init(weights);
+		for (size_t k = 0; k < weights.size(); k++)
+			modes.mixed->widen(k, weights[k]);
+	}
+	bool mixed = modes.mixed != NULL;
+
+	// the training set is either in memory or streamed from disk in chunks (-stream)
+	unique_ptr<SampleStream> trainStream;
+	if (options.trainStreamFile != NULL)
+	{
+		if (options.batchSize <= 0)
+		{
+			fprintf(stderr, "-stream needs a -batchSize\n");
+			exit(EXIT_FAILURE);
+		}
+		trainStream.reset(new SampleStream(listShards(options.trainStreamFile), options.streamBudget, options.batchSize, options.useCache));
+		if (trainStream->shardCount() > 1)
+			cout << "Streaming training data from " << trainStream->shardCount() << " shards of " << options.trainStreamFile;
+		else
+			cout << "Streaming training data from " << (trainStream->fromCache() ? "the cache of " : "") << options.trainStreamFile;
+		cout << " in chunks of " << trainStream->chunkCapacity() << " samples, each with " << trainStream->dims() << " dimensions." << endl;
+	}
+	double trainCost, trainAcc, testCost, testAcc;
+	if (options.batchSize <= 0)
+		options.batchSize = trainSet.count;
+	int batchSize = options.batchSize;
+	// all buffers of training and evaluation, allocated once for the network and the batch size; the
+	// training ones only hold what the way of training needs, every evaluation runs in evalSpace
+	WorkspaceUse trainUse = options.compactActivations || mixed ? WORKSPACE_TRAIN_SAVED : WORKSPACE_TRAIN;
+	Workspace<Scalar> trainSpace(weights, batchSize, trainUse), evalSpace(weights, batchSize, WORKSPACE_EVAL);
+
+	// initial test
+	if (trainStream)
+		EvalStream(*trainStream, batchSize, weights, evalSpace, trainCost, trainAcc);
+	else
+		EvalData(trainSet.inputs(), trainSet.labels(), batchSize, weights, evalSpace, trainCost, trainAcc);
+	EvalData(testSet.inputs(), testSet.labels(), batchSize, weights, evalSpace, testCost, testAcc);
+	cout << "Training Eval: " << trainCost << endl;
+	cout << "Testing Eval: " << testCost << endl;
+	cout << "Training Accuracy: " << trainAcc << endl;
+	cout << "Testing Accuracy: " << testAcc << endl;
+
+	// SLIDE training replaces the dense kernels of the plain float/double network
+	if (options.slideBits > 0)
+	{
+		if (numHiddenLayers == 0 || options.compactActivations || mixed)
+		{
+			fprintf(stderr, "-slide needs hidden layers, and does not go with -compactActivations, bf16 or half\n");
+			exit(EXIT_FAILURE);
+		}
+		modes.slide.reset(new SlideTraining<Scalar>(weights, options.slideBits, options.slideTables, options.slideRebuild));
+		options.sparseDensity = options.activationDensity = 0;
+	}
+
+	// the sparse first layer is for the plain float/double network on unaugmented samples
+	if (options.augmentShift > 0 || options.compactActivations || mixed)
+		options.sparseDensity = 0;
+	if (options.activationDensity > 0 && !options.compactActivations && !mixed)
+		modes.sparseActivations.reset(new SparseActivations<Scalar>(options.activationDensity));
+	if (options.sparseDensity > 0 && !trainStream)
+	{
+		modes.sparseInputs.reset(new SparseSamples(trainSet.inputs()));
+		if (verbose)
+			cout << "Training inputs are " << 100 * modes.sparseInputs->density(0, trainSet.count) << "% nonzero" << endl;
+	}
+
+	// backprob on the training set, repeat for n_iter interations, with the step size of RunML
+	const Scalar learningRate = Scalar(0.001);
+	BatchPipeline<Scalar> pipeline(options.prefetchDepth, options.augmentShift);
+
+	for (int i = 0; i < n_iter; i++)
+	{
+		// backprob
+		cout << endl << "backprob iteration " << i << endl;
+
+		// do in batches, chunk by chunk when streaming
+		if (trainStream)
+		{
+			while (trainStream->next())
+			{
+				// every chunk is converted once as it comes in
+				if (options.sparseDensity > 0)
+					modes.sparseInputs.reset(new SparseSamples(trainStream->inputs()));
+				TrainEpoch(pipeline, trainStream->inputs(), trainStream->labels(), options, modes, learningRate, weights, trainSpace);
+			}
+		}
+		else
+			TrainEpoch(pipeline, trainSet.inputs(), trainSet.labels(), options, modes, learningRate, weights, trainSpace);
+		if (verbose)
+			cout << "Waited " << pipeline.stallSeconds() << " s in total for training batches" << endl;
+		if (verbose && modes.slide)
+			cout << "SLIDE computed " << 100 * modes.slide->activeFraction() << "% of the hidden neurons so far, rebuilt the hash tables " << modes.slide->rebuildCount() << " times" << endl;
+		if (verbose && modes.sparseActivations)
+			cout << modes.sparseActivations->sparseCount << " of " << modes.sparseActivations->sparseCount + modes.sparseActivations->denseCount << " hidden layers ran sparse so far" << endl;
+
+		// re-test
+		if (trainStream)
+			EvalStream(*trainStream, batchSize, weights, evalSpace, trainCost, trainAcc);
+		else
+			EvalData(trainSet.inputs(), trainSet.labels(), batchSize, weights, evalSpace, trainCost, trainAcc);
+		EvalData(testSet.inputs(), testSet.labels(), batchSize, weights, evalSpace, testCost, testAcc);
+		cout << "Training Eval: " << trainCost << endl;
+		cout << "Testing Eval: " << testCost << endl;
+		cout << "Training Accuracy: " << trainAcc << endl;
+		cout << "Testing Accuracy: " << testAcc << endl;
+	}
+
+	cout << endl << "Printing the result for the first 5 samples in the train set:" << endl;
+	if (trainStream)
+	{
+		// read from the first shard on a stream of its own, leaving the training stream where it is
+		SampleStream first(listShards(options.trainStreamFile)[0].c_str(), 0, 5, options.useCache);
+		if (first.next())
+			PrintFirstSamples(first.inputs(), first.labels(), weights);
+	}
+	else
+		PrintFirstSamples(trainSet.inputs(), trainSet.labels(), weights);
+
+	cout << endl << "Printing the result for the first 5 samples in the test set:" << endl;
+	PrintFirstSamples(testSet.inputs(), testSet.labels(), weights);
+
+	if (options.int8Calibration > 0)
+	{
+		if (trainStream)
+			CompareInt8(weights, trainStream->inputs().leftCols(min<int>(options.int8Calibration, trainStream->inputs().cols())), testSet, batchSize, evalSpace);
+		else
+			CompareInt8(weights, trainSet.inputs().leftCols(min<int>(options.int8Calibration, trainSet.count)), testSet, batchSize, evalSpace);
+	}
+	if (options.fixedTopology)
+		CompareFixed(weights, testSet, evalSpace);
+}
+
 int main(int argc, char* argv[]) {
 	// first argument is program name
 	argv++, argc--;
@@ -106,19 +1014,18 @@ int main(int argc, char* argv[]) {
 		ShowUsage();
 	}
 
-	MatrixXd trainInput;
-	VectorXi trainLabel;
-	MatrixXd testInput;
-	VectorXi testLabel;
+	DataSet trainSet;
+	DataSet testSet;
 
 	// testing
 	cout << "start" << endl;
 
-	int nHidden = 100;
-	int nClasses = 10;
-	int numHiddenLayers = 1;
-	vector<int> nHiddens{ nHidden };
-	int batchSize;
+	TrainOptions options;
+	int nHidden = options.nHiddens[0];
+	int nClasses = options.nClasses;
+	vector<PendingLoad> pendingLoads;
+	bool shareData = false;
+	bool doublePrecision = false;
 
 	// parse arguments
 	while (argc > 0)
@@ -132,7 +1039,7 @@ int main(int argc, char* argv[]) {
 				CheckOption(*argv, argc, numopts + 1);
 
 				nHidden = atoi(argv[1]); // this is used as single hidden layer set-up
-				nHiddens[0] = nHidden; // this is used as multiple hiddden layer set-up
+				options.nHiddens[0] = nHidden; // this is used as multiple hiddden layer set-up
 
 				argv += numopts + 1, argc -= numopts + 1;
 			}
@@ -143,18 +1050,18 @@ int main(int argc, char* argv[]) {
 				CheckOption(*argv, argc, numopts + 1);
 
 				// read the number of hidden layers
-				numHiddenLayers = atoi(argv[1]);
+				options.numHiddenLayers = atoi(argv[1]);
 
 				argv += numopts + 1, argc -= numopts + 1;
 
 				// multiple hiddden layer set-up
-				nHiddens.resize(numHiddenLayers);
-				for (int i = 0; i < numHiddenLayers; i++)
-					nHiddens[i] = atoi(argv[i]);
+				options.nHiddens.resize(options.numHiddenLayers);
+				for (int i = 0; i < options.numHiddenLayers; i++)
+					options.nHiddens[i] = atoi(argv[i]);
 				// single hiddden layer set-up	
-				nHidden = nHiddens[0];
+				nHidden = options.nHiddens[0];
 
-				argv += numHiddenLayers, argc -= numHiddenLayers;
+				argv += options.numHiddenLayers, argc -= options.numHiddenLayers;
 			}
 			else if (!strcmp(*argv, "-batchSize"))
 			{
@@ -163,7 +1070,200 @@ int main(int argc, char* argv[]) {
 				CheckOption(*argv, argc, numopts + 1);
 
 				// read the number of hidden layers
-				batchSize = atoi(argv[1]);
+				options.batchSize = atoi(argv[1]);
+
+				argv += numopts + 1, argc -= numopts + 1;
+			}
+			else if (!strcmp(*argv, "-noCache"))
+			{
+				int numopts = 0;
+				// numopts+1 because parameter name itself counts
+				CheckOption(*argv, argc, numopts + 1);
+
+				// always parse the CSV files and never write <file>.mlcache
+				options.useCache = false;
+
+				argv += numopts + 1, argc -= numopts + 1;
+			}
+			else if (!strcmp(*argv, "-shareData"))
+			{
+				int numopts = 0;
+				// numopts+1 because parameter name itself counts
+				CheckOption(*argv, argc, numopts + 1);
+
+				// the first process to load a data set publishes it in shared memory, later ones map it
+				shareData = true;
+
+				argv += numopts + 1, argc -= numopts + 1;
+			}
+			else if (!strcmp(*argv, "-stream"))
+			{
+				int numopts = 1;
+				// numopts+1 because parameter name itself counts
+				CheckOption(*argv, argc, numopts + 1);
+
+				// memory budget in MB for the training set, which is then read in chunks by -ML_adv
+				options.streamBudget = (size_t)atoi(argv[1]) << 20;
+
+				argv += numopts + 1, argc -= numopts + 1;
+			}
+			else if (!strcmp(*argv, "-prefetch"))
+			{
+				int numopts = 1;
+				// numopts+1 because parameter name itself counts
+				CheckOption(*argv, argc, numopts + 1);
+
+				// number of training batches prepared ahead on a separate thread, 0 to gather them in line
+				options.prefetchDepth = atoi(argv[1]);
+
+				argv += numopts + 1, argc -= numopts + 1;
+			}
+			else if (!strcmp(*argv, "-augmentShift"))
+			{
+				int numopts = 1;
+				// numopts+1 because parameter name itself counts
+				CheckOption(*argv, argc, numopts + 1);
+
+				// translate every training image by up to this many pixels
+				options.augmentShift = atoi(argv[1]);
+
+				argv += numopts + 1, argc -= numopts + 1;
+			}
+			else if (!strcmp(*argv, "-precision"))
+			{
+				int numopts = 1;
+				// numopts+1 because parameter name itself counts
+				CheckOption(*argv, argc, numopts + 1);
+
+				// the precision -ML_adv trains and evaluates in; bf16 and half store the weights
+				// and saved activations in 16 bits but compute in float
+				doublePrecision = false;
+				options.storage = STORAGE_NATIVE;
+				if (!strcmp(argv[1], "double"))
+					doublePrecision = true;
+				else if (!strcmp(argv[1], "bf16"))
+					options.storage = STORAGE_BF16;
+				else if (!strcmp(argv[1], "half"))
+					options.storage = STORAGE_HALF;
+				else if (strcmp(argv[1], "float") != 0)
+				{
+					fprintf(stderr, "invalid precision: %s\n", argv[1]);
+					ShowUsage();
+				}
+
+				argv += numopts + 1, argc -= numopts + 1;
+			}
+			else if (!strcmp(*argv, "-stochasticRounding"))
+			{
+				int numopts = 0;
+				// numopts+1 because parameter name itself counts
+				CheckOption(*argv, argc, numopts + 1);
+
+				// with -precision bf16|half, round the updated weights stochastically and keep no fp32 master copy
+				options.stochasticRounding = true;
+
+				argv += numopts + 1, argc -= numopts + 1;
+			}
+			else if (!strcmp(*argv, "-int8"))
+			{
+				int numopts = 1;
+				// numopts+1 because parameter name itself counts
+				CheckOption(*argv, argc, numopts + 1);
+
+				// after -ML_adv, quantize the network calibrated on this many training samples and compare
+				options.int8Calibration = atoi(argv[1]);
+
+				argv += numopts + 1, argc -= numopts + 1;
+			}
+			else if (!strcmp(*argv, "-fixedTopology"))
+			{
+				int numopts = 0;
+				// numopts+1 because parameter name itself counts
+				CheckOption(*argv, argc, numopts + 1);
+
+				// after training, run the test set through the network compiled in for the topology
+				options.fixedTopology = true;
+
+				argv += numopts + 1, argc -= numopts + 1;
+			}
+			else if (!strcmp(*argv, "-sparseInputs"))
+			{
+				int numopts = 1;
+				// numopts+1 because parameter name itself counts
+				CheckOption(*argv, argc, numopts + 1);
+
+				// training batches with at most this fraction of nonzero inputs take the sparse first layer
+				options.sparseDensity = atof(argv[1]);
+
+				argv += numopts + 1, argc -= numopts + 1;
+			}
+			else if (!strcmp(*argv, "-sparseActivations"))
+			{
+				int numopts = 1;
+				// numopts+1 because parameter name itself counts
+				CheckOption(*argv, argc, numopts + 1);
+
+				// hidden layers of a training batch with at most this fraction of nonzeros go sparse
+				options.activationDensity = atof(argv[1]);
+
+				argv += numopts + 1, argc -= numopts + 1;
+			}
+			else if (!strcmp(*argv, "-slide"))
+			{
+				int numopts = 3;
+				// numopts+1 because parameter name itself counts
+				CheckOption(*argv, argc, numopts + 1);
+
+				// hash bits per table, number of tables, batches between rebuilds of the tables
+				options.slideBits = atoi(argv[1]);
+				options.slideTables = atoi(argv[2]);
+				options.slideRebuild = atoi(argv[3]);
+				if (options.slideBits <= 0 || options.slideBits > 20 || options.slideTables <= 0)
+					ShowUsage();
+
+				argv += numopts + 1, argc -= numopts + 1;
+			}
+			else if (!strcmp(*argv, "-isa"))
+			{
+				int numopts = 1;
+				// numopts+1 because parameter name itself counts
+				CheckOption(*argv, argc, numopts + 1);
+
+				// the build of the kernels to run on, instead of the best one for this CPU
+				if (!selectIsa(argv[1]))
+				{
+					fprintf(stderr, "-isa %s: not one of sse2, avx2, avx512, auto, not in this build or not supported by this CPU\n", argv[1]);
+					exit(EXIT_FAILURE);
+				}
+
+				argv += numopts + 1, argc -= numopts + 1;
+			}
+			else if (!strcmp(*argv, "-benchGemm"))
+			{
+				int numopts = 0;
+				// numopts+1 because parameter name itself counts
+				CheckOption(*argv, argc, numopts + 1);
+
+				// the matrix products of the -nHiddens network in the -precision, with -batchSize (default 100)
+				vector<int> layerSizes{ 784 };
+				for (int i = 0; i < options.numHiddenLayers; i++)
+					layerSizes.push_back(options.nHiddens[i]);
+				layerSizes.push_back(nClasses);
+				if (doublePrecision)
+					BenchGemm<double>(layerSizes, options.batchSize > 0 ? options.batchSize : 100);
+				else
+					BenchGemm<float>(layerSizes, options.batchSize > 0 ? options.batchSize : 100);
+
+				argv += numopts + 1, argc -= numopts + 1;
+			}
+			else if (!strcmp(*argv, "-compactActivations"))
+			{
+				int numopts = 0;
+				// numopts+1 because parameter name itself counts
+				CheckOption(*argv, argc, numopts + 1);
+
+				// keep hidden layers for backprop as ReLU bit masks plus float nonzeros (-ML_adv only)
+				options.compactActivations = true;
 
 				argv += numopts + 1, argc -= numopts + 1;
 			}
@@ -173,11 +1273,19 @@ int main(int argc, char* argv[]) {
 				// numopts+1 because parameter name itself counts
 				CheckOption(*argv, argc, numopts + 1);
 
-				// Load the data from the test set
-				ReadData(argv[1], trainInput, trainLabel);
-				cout << "Read in training data with " << trainInput.cols() << " samples, each with " << trainInput.rows() << " dimensions." << endl;
+				if (options.streamBudget > 0)
+				{
+					options.trainStreamFile = argv[1];
+					argv += numopts + 1, argc -= numopts + 1;
+					continue;
+				}
 
-				batchSize = trainInput.cols();
+				// Load the data from the training set in the background, see WaitForData
+				const char* file = argv[1];
+				bool useCache = options.useCache;
+				pendingLoads.push_back(PendingLoad{ async(launch::async, [=, &trainSet]() { ReadSharedData(file, trainSet, useCache, shareData); }), "training", &trainSet });
+
+				options.batchSize = 0;
 
 				argv += numopts + 1, argc -= numopts + 1;
 			}
@@ -187,9 +1295,38 @@ int main(int argc, char* argv[]) {
 				// numopts+1 because parameter name itself counts
 				CheckOption(*argv, argc, numopts + 1);
 
-				// Load the data from the test set
-				ReadData(argv[1], testInput, testLabel);
-				cout << "Read in testing data with " << testInput.cols() << " samples, each with " << testInput.rows() << " dimensions." << endl;
+				// Load the data from the test set in the background, see WaitForData
+				const char* file = argv[1];
+				bool useCache = options.useCache;
+				pendingLoads.push_back(PendingLoad{ async(launch::async, [=, &testSet]() { ReadSharedData(file, testSet, useCache, shareData); }), "testing", &testSet });
+
+				argv += numopts + 1, argc -= numopts + 1;
+			}
+			else if (!strcmp(*argv, "-trainIdx"))
+			{
+				int numopts = 2;
+				// numopts+1 because parameter name itself counts
+				CheckOption(*argv, argc, numopts + 1);
+
+				// Load the data from the IDX image and label files in the background, see WaitForData
+				const char* imageFile = argv[1];
+				const char* labelFile = argv[2];
+				pendingLoads.push_back(PendingLoad{ async(launch::async, [=, &trainSet]() { ReadSharedIdx(imageFile, labelFile, trainSet, shareData); }), "training", &trainSet });
+
+				options.batchSize = 0;
+
+				argv += numopts + 1, argc -= numopts + 1;
+			}
+			else if (!strcmp(*argv, "-testIdx"))
+			{
+				int numopts = 2;
+				// numopts+1 because parameter name itself counts
+				CheckOption(*argv, argc, numopts + 1);
+
+				// Load the data from the IDX image and label files in the background, see WaitForData
+				const char* imageFile = argv[1];
+				const char* labelFile = argv[2];
+				pendingLoads.push_back(PendingLoad{ async(launch::async, [=, &testSet]() { ReadSharedIdx(imageFile, labelFile, testSet, shareData); }), "testing", &testSet });
 
 				argv += numopts + 1, argc -= numopts + 1;
 			}
@@ -198,6 +1335,11 @@ int main(int argc, char* argv[]) {
 				int numopts = 0;
 				// numopts+1 because parameter name itself counts
 				CheckOption(*argv, argc, numopts + 1);
+				WaitForData(pendingLoads);
+
+				// this command works on the whole data set at once
+				MatrixXd testInput = testSet.inputs().cast<double>();
+				VectorXi testLabel = testSet.labels().cast<int>();
 
 				// set up the network
 				MatrixXd inputToHidden = MatrixXd::Random(nHidden, 784) * 0.1;
@@ -222,6 +1364,11 @@ int main(int argc, char* argv[]) {
 				int numopts = 0;
 				// numopts+1 because parameter name itself counts
 				CheckOption(*argv, argc, numopts + 1);
+				WaitForData(pendingLoads);
+
+				// this command works on the whole data set at once
+				MatrixXd testInput = testSet.inputs().cast<double>();
+				VectorXi testLabel = testSet.labels().cast<int>();
 
 				// set up the network
 				MatrixXd inputToHidden = MatrixXd::Random(nHidden, 784) * 0.1;
@@ -259,6 +1406,13 @@ int main(int argc, char* argv[]) {
 				int numopts = 1;
 				// numopts+1 because parameter name itself counts
 				CheckOption(*argv, argc, numopts + 1);
+				WaitForData(pendingLoads);
+
+				// this command works on the whole data set at once
+				MatrixXd trainInput = trainSet.inputs().cast<double>();
+				VectorXi trainLabel = trainSet.labels().cast<int>();
+				MatrixXd testInput = testSet.inputs().cast<double>();
+				VectorXi testLabel = testSet.labels().cast<int>();
 
 				// read additional arguments
 				int n_iter = atoi(argv[1]);
@@ -269,13 +1423,11 @@ int main(int argc, char* argv[]) {
 				MatrixXd trainHiddenLayer, testHiddenLayer;
 				MatrixXd trainOutputLayer, testOutputLayer;
 
-				// initial test
-				ForwardProp(trainInput, inputToHidden, hiddenToOutput, trainHiddenLayer, trainOutputLayer);
-				ForwardProp(testInput, inputToHidden, hiddenToOutput, testHiddenLayer, testOutputLayer);
-				cout << "Training Eval: " << CostEval(trainOutputLayer, trainLabel) << endl;
-				cout << "Testing Eval: " << CostEval(testOutputLayer, testLabel) << endl;
-				cout << "Training Accuracy: " << accuracy(trainOutputLayer, trainLabel) << endl;
-				cout << "Testing Accuracy: " << accuracy(testOutputLayer, testLabel) << endl;
+				// initial test, on the logits; only the training set needs its probabilities, for backprop
+				ForwardLogits(trainInput, inputToHidden, hiddenToOutput, trainHiddenLayer, trainOutputLayer);
+				ForwardLogits(testInput, inputToHidden, hiddenToOutput, testHiddenLayer, testOutputLayer);
+				PrintEval(trainOutputLayer, trainLabel, testOutputLayer, testLabel);
+				softmax<double>(trainOutputLayer);
 
 				// backprob on the training set, repeat for n_iter interations
 				MatrixXd inputToHiddenGrad;
@@ -292,13 +1444,12 @@ int main(int argc, char* argv[]) {
 					hiddenToOutput -= 0.001 * hiddenToOutputGrad;
 
 					// re-test
-					ForwardProp(trainInput, inputToHidden, hiddenToOutput, trainHiddenLayer, trainOutputLayer);
-					ForwardProp(testInput, inputToHidden, hiddenToOutput, testHiddenLayer, testOutputLayer);
-					cout << "Training Eval: " << CostEval(trainOutputLayer, trainLabel) << endl;
-					cout << "Testing Eval: " << CostEval(testOutputLayer, testLabel) << endl;
-					cout << "Training Accuracy: " << accuracy(trainOutputLayer, trainLabel) << endl;
-					cout << "Testing Accuracy: " << accuracy(testOutputLayer, testLabel) << endl;
+					ForwardLogits(trainInput, inputToHidden, hiddenToOutput, trainHiddenLayer, trainOutputLayer);
+					ForwardLogits(testInput, inputToHidden, hiddenToOutput, testHiddenLayer, testOutputLayer);
+					PrintEval(trainOutputLayer, trainLabel, testOutputLayer, testLabel);
+					softmax<double>(trainOutputLayer);
 				}
+				softmax<double>(testOutputLayer);
 
 				cout << endl << "Printing the result for the first 5 samples in the train set:" << endl;
 				for (int j = 0; j < 5; j++)
@@ -315,84 +1466,15 @@ int main(int argc, char* argv[]) {
 				int numopts = 1;
 				// numopts+1 because parameter name itself counts
 				CheckOption(*argv, argc, numopts + 1);
+				WaitForData(pendingLoads);
 
 				// read additional arguments
 				int n_iter = atoi(argv[1]);
 
-				// set up the network
-				vector<MatrixXd> weights;
-				vector<MatrixXd> trainHiddenLayers(numHiddenLayers), testHiddenLayers(numHiddenLayers);
-				MatrixXd trainOutputLayer, testOutputLayer;
-				if (numHiddenLayers == 0)
-				{
-					weights.push_back(MatrixXd::Random(nClasses, 784) * 0.1);
-				}
+				if (doublePrecision)
+					RunML_Adv<double>(n_iter, options, trainSet, testSet);
 				else
-				{
-					weights.push_back(MatrixXd::Random(nHiddens[0], 784) * 0.1);
-					for (int i = 0; i < numHiddenLayers - 1; i++)
-						weights.push_back(MatrixXd::Random(nHiddens[i + 1], nHiddens[i]) * 0.1);
-					weights.push_back(MatrixXd::Random(nClasses, nHiddens[numHiddenLayers - 1]) * 0.1);
-				}
-
-				// initial test
-				ForwardProp_Adv(trainInput, weights, trainHiddenLayers, trainOutputLayer);
-				ForwardProp_Adv(testInput, weights, testHiddenLayers, testOutputLayer);
-				cout << "Training Eval: " << CostEval(trainOutputLayer, trainLabel) << endl;
-				cout << "Testing Eval: " << CostEval(testOutputLayer, testLabel) << endl;
-				cout << "Training Accuracy: " << accuracy(trainOutputLayer, trainLabel) << endl;
-				cout << "Testing Accuracy: " << accuracy(testOutputLayer, testLabel) << endl;
-
-				// backprob on the training set, repeat for n_iter interations
-				vector<MatrixXd> weightGrads(numHiddenLayers + 1);
-
-				int numBatches = trainInput.cols() / batchSize;
-				int remainSize = trainInput.cols() % batchSize;
-				if (remainSize > 0)
-					numBatches++;
-
-				for (int i = 0; i < n_iter; i++)
-				{
-					// backprob
-					cout << endl << "backprob iteration " << i << endl;
-
-					// do in batches
-					int tmpIndex = 0;
-					vector<int> indices;
-					for (int j = 0; j < numBatches; j++)
-					{
-						indices.push_back(tmpIndex);
-						tmpIndex += batchSize;
-					}
-					random_shuffle_in_place(indices);
-					for (int j = 0; j < numBatches; j++)
-					{
-						int startIndex = indices[j];
-						int actualSize = (batchSize > trainInput.cols() - startIndex ? trainInput.cols() - startIndex : batchSize);
-						MatrixXd subTrainInput = trainInput.block(0, startIndex, trainInput.rows(), actualSize);
-						VectorXi subTrainLabel = trainLabel.block(startIndex, 0, actualSize, 1);
-						ForwardProp_Adv(subTrainInput, weights, trainHiddenLayers, trainOutputLayer);
-						BackProp_Adv(subTrainInput, weights, trainHiddenLayers, trainOutputLayer, subTrainLabel, weightGrads);
-						for (int k = 0; k < weights.size(); k++)
-							weights[k] -= 0.001 * weightGrads[k];
-					}
-
-					// re-test
-					ForwardProp_Adv(trainInput, weights, trainHiddenLayers, trainOutputLayer);
-					ForwardProp_Adv(testInput, weights, testHiddenLayers, testOutputLayer);
-					cout << "Training Eval: " << CostEval(trainOutputLayer, trainLabel) << endl;
-					cout << "Testing Eval: " << CostEval(testOutputLayer, testLabel) << endl;
-					cout << "Training Accuracy: " << accuracy(trainOutputLayer, trainLabel) << endl;
-					cout << "Testing Accuracy: " << accuracy(testOutputLayer, testLabel) << endl;
-				}
-
-				cout << endl << "Printing the result for the first 5 samples in the train set:" << endl;
-				for (int j = 0; j < 5; j++)
-					cout << trainOutputLayer.col(j).transpose() << " Ground Truth: " << trainLabel(j) << endl;
-
-				cout << endl << "Printing the result for the first 5 samples in the test set:" << endl;
-				for (int j = 0; j < 5; j++)
-					cout << testOutputLayer.col(j).transpose() << " Ground Truth: " << testLabel(j) << endl;
+					RunML_Adv<float>(n_iter, options, trainSet, testSet);
 
 				argv += numopts + 1, argc -= numopts + 1;
 			}
@@ -409,6 +1491,8 @@ int main(int argc, char* argv[]) {
 		}
 	}
 
+	WaitForData(pendingLoads);
+
 	return EXIT_SUCCESS;
 }
 
@@ -419,7 +1503,50 @@ int main(int argc, char* argv[]) {
 static char options[] =
 "-help (show this message)\n"
 "-v verbose output\n"
-"-forwardProp\n"
+"-nHidden <n> neurons in the hidden layer (default 100); the -forwardProp, -backProp and -ML\n"
+"    network, and the first layer of -nHiddens\n"
+"-nHiddens <layers> <n1> ... <n_layers> number and sizes of the hidden layers of the -ML_adv network\n"
+"-batchSize <n> training samples per weight update in -ML_adv (default 0, the whole training set)\n"
+"-trainSet <csv> / -testSet <csv> (a binary <csv>.mlcache is kept next to each file)\n"
+"    <csv> may also be a glob such as \"shards/part-*.csv\" or @<list> naming one shard per line\n"
+"-noCache do not read or write .mlcache files (must precede -trainSet/-testSet)\n"
+"-shareData keep one copy of each data set per host in shared memory, mapped read-only by\n"
+"    every process using it and released with the last one (must precede the data sets; on\n"
+"    Linux see /dev/shm/motionlearn-*)\n"
+"-stream <MB> stream the -trainSet from disk within this memory budget (-ML_adv only, must precede -trainSet)\n"
+"-prefetch <n> training batches prepared ahead on a separate thread (default 2, 0 = none)\n"
+"-augmentShift <pixels> randomly translate training images by up to this many pixels\n"
+"-precision float|double|bf16|half arithmetic used by -ML_adv (default float); bf16 and half\n"
+"    keep weights and saved activations in 16 bits, with an fp32 master copy of the weights\n"
+"-stochasticRounding round 16-bit weight updates stochastically instead of keeping a master copy\n"
+"-int8 <n> after -ML_adv, quantize the network to int8 (calibrated on n training samples) and\n"
+"    report its test accuracy and throughput against the trained network\n"
+"-fixedTopology after -ML_adv, run the test set one sample at a time through the network compiled\n"
+"    in for its layer sizes (fixed-size, heap-free; see FixedMlp.cpp for the list) against the\n"
+"    dynamic network\n"
+"-sparseInputs <d> under -ML_adv, convert the training inputs once to a compressed sparse form\n"
+"    and run the first layer on the nonzero inputs alone in batches with at most the fraction d\n"
+"    of nonzero inputs (0.35 suits MNIST); not with -augmentShift, -compactActivations, bf16 or half\n"
+"-sparseActivations <d> under -ML_adv, hidden layers of a training batch with at most the\n"
+"    fraction d of nonzeros feed the next layer and its backprop in sparse form; not with\n"
+"    -compactActivations, bf16 or half\n"
+"-slide <bits> <tables> <rebuild> under -ML_adv, train SLIDE-style: every sample only computes\n"
+"    the hidden neurons that share a bucket with it in <tables> SimHash tables of <bits> bits over\n"
+"    the layer's weights, rebuilt in the background every <rebuild> batches (0 = never); for very\n"
+"    wide hidden layers, not with -compactActivations, bf16 or half\n"
+"-isa sse2|avx2|avx512|auto run the kernels built for this instruction set (default auto, the\n"
+"    best one the CPU supports), for benchmarking\n"
+"-benchGemm time the matrix product kernels on the products of the -nHiddens network at -batchSize\n"
+"    (and 1 and 8 samples) in the -precision, against Eigen's\n"
+"-compactActivations save hidden layers for backprop as bit masks and float nonzeros (less memory)\n"
+"-trainIdx <images-idx3-ubyte> <labels-idx1-ubyte> / -testIdx <images> <labels>\n"
+"-forwardProp run the test set once through a random -nHidden network and print its cost\n"
+"-backProp one backprop step of a random -nHidden network on the whole test set, with its cost\n"
+"    before and after\n"
+"-ML <n_iter> train the -nHidden network for n_iter full-batch iterations on the training set in\n"
+"    double precision, reporting accuracies after each\n"
+"-ML_adv <n_iter> train the -nHiddens network for n_iter epochs of -batchSize batches, with the\n"
+"    options above, reporting accuracies after each\n"
 ;
 
 static void ShowUsage(void)
@@ -0,0 +1,87 @@
+#include "Quantize.h"
+#include "Kernels.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+// the full int8 range: the kernels multiply in int16 and sum in int32 (see Kernels.inl)
+static const int weightLimit = 127;
+
+static int roundUp32(int n) {
+	return (n + 31) & ~31;
+}
+const char* QuantizedNetwork::kernelName() {
+	return currentKernels().quantizedGemmName;
+}
+QuantizedNetwork::QuantizedNetwork(const std::vector<Eigen::MatrixXf>& weights, const Eigen::Ref<const MatrixXu8>& calibration) {
+	// the float network on the calibration samples gives the range of every hidden layer
+	Eigen::MatrixXf activations = calibration.cast<float>();
+	for (size_t l = 0; l < weights.size(); l++) {
+		const Eigen::MatrixXf& w = weights[l];
+		Layer layer;
+		layer.outputs = (int)w.rows();
+		layer.inputs = (int)w.cols();
+		layer.stride = roundUp32(layer.inputs);
+		layer.weights.assign((size_t)layer.outputs * layer.stride, 0);
+		layer.weightScale.resize(layer.outputs);
+		for (int o = 0; o < layer.outputs; o++) {
+			float maxAbs = w.row(o).cwiseAbs().maxCoeff();
+			float scale = maxAbs > 0 ? maxAbs / weightLimit : 1;
+			for (int i = 0; i < layer.inputs; i++)
+				layer.weights[(size_t)o * layer.stride + i] = (int16_t)std::lround(w(o, i) / scale);
+			layer.weightScale[o] = scale;
+		}
+		layer.outputScale = 0;
+		if (l + 1 < weights.size()) {
+			activations = (w * activations).cwiseMax(0.0f);
+			float maxValue = activations.size() > 0 ? activations.maxCoeff() : 0;
+			layer.outputScale = maxValue > 0 ? maxValue / 255 : 1;
+		}
+		layers.push_back(layer);
+	}
+}
+void QuantizedNetwork::forward(const Eigen::Ref<const MatrixXu8>& inputs, Eigen::MatrixXf& logits) const {
+	int n = (int)inputs.cols();
+	// uint8 activations of the current layer as int16, one zero-padded column of stride per sample
+	std::vector<int16_t> x((size_t)layers[0].stride * n, 0);
+	for (int j = 0; j < n; j++)
+		std::copy(inputs.col(j).data(), inputs.col(j).data() + layers[0].inputs, &x[(size_t)j * layers[0].stride]);
+
+	std::vector<int16_t> next;
+	std::vector<int32_t> acc;
+	std::vector<float> multiplier;
+	float inputScale = 1;
+	const IsaKernels& kernels = currentKernels();
+	for (size_t l = 0; l < layers.size(); l++) {
+		const Layer& layer = layers[l];
+		bool last = l + 1 == layers.size();
+		acc.resize((size_t)layer.outputs * n);
+		multiplier.resize(layer.outputs);
+		for (int o = 0; o < layer.outputs; o++)
+			multiplier[o] = layer.weightScale[o] * inputScale / (last ? 1 : layer.outputScale);
+		kernels.quantizedGemm(layer.weights.data(), layer.outputs, layer.stride, x.data(), n, acc.data());
+		if (last) {
+			logits.resize(layer.outputs, n);
+			for (int j = 0; j < n; j++)
+				for (int o = 0; o < layer.outputs; o++)
+					logits(o, j) = acc[(size_t)j * layer.outputs + o] * multiplier[o];
+		}
+		else {
+			// requantize to uint8, the clamp at 0 being the ReLU
+			next.assign((size_t)layers[l + 1].stride * n, 0);
+			for (int j = 0; j < n; j++) {
+				const int32_t* a = &acc[(size_t)j * layer.outputs];
+				int16_t* y = &next[(size_t)j * layers[l + 1].stride];
+				for (int o = 0; o < layer.outputs; o++) {
+					// clamped at 255 as float, before the conversion, and at 0 as int, which
+					// compiles without branches (the float compares as branches cost ten times that)
+					float v = a[o] * multiplier[o] + 0.5f;
+					int q = (int)(v < 255 ? v : 255);
+					y[o] = (int16_t)(q > 0 ? q : 0);
+				}
+			}
+			x.swap(next);
+		}
+		inputScale = layer.outputScale;
+	}
+}
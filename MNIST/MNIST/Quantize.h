@@ -0,0 +1,33 @@
+#pragma once
+#include "lib/Eigen/Core"
+#include <cstdint>
+#include <vector>
+#include "MIO.h"
+
+// A trained ReLU network quantized for int8 inference. Every layer has int8 weights with one scale
+// per output channel, and the hidden activations are requantized to uint8 with one scale per layer,
+// calibrated on sample inputs; the raw uint8 pixels feed the first layer as they are. The products
+// are blocked over the samples of a batch and accumulate in int32 from the values widened to int16
+// (AVX-512BW, AVX2 or SSE2 madd, or portable C++, with identical results), and requantization is
+// fused with the ReLU. Only the last layer produces float logits.
+class QuantizedNetwork {
+public:
+	// quantizes the trained weights, calibrating the activation ranges on the given samples
+	QuantizedNetwork(const std::vector<Eigen::MatrixXf>& weights, const Eigen::Ref<const MatrixXu8>& calibration);
+	// the logits for a batch of samples
+	void forward(const Eigen::Ref<const MatrixXu8>& inputs, Eigen::MatrixXf& logits) const;
+	// the int8 kernel in use (see -isa)
+	static const char* kernelName();
+private:
+	struct Layer {
+		int outputs, inputs;
+		// inputs rounded up to a multiple of 32, the row length of weights
+		int stride;
+		// the int8 weights as int16, for the kernel (see quantizedGemm in Kernels.h)
+		std::vector<int16_t> weights;
+		std::vector<float> weightScale;
+		// scale of the uint8 output activations, 0 for the last layer
+		float outputScale;
+	};
+	std::vector<Layer> layers;
+};
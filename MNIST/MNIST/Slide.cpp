@@ -0,0 +1,208 @@
+#include "Slide.h"
+#include <chrono>
+
+template <typename Scalar>
+SimHashTables<Scalar>::SimHashTables(int dims, int bits, int tables, std::mt19937& rng) : bits(bits), tables(tables) {
+	std::bernoulli_distribution sign(0.5);
+	MatrixX<Scalar>* directions = new MatrixX<Scalar>(bits * tables, dims);
+	for (int j = 0; j < dims; j++)
+		for (int i = 0; i < bits * tables; i++)
+			(*directions)(i, j) = sign(rng) ? Scalar(1) : Scalar(-1);
+	projections.reset(directions);
+}
+template <typename Scalar>
+SimHashTables<Scalar>::SimHashTables(const SimHashTables& previous, const RowMatrixX<Scalar>& rows, const std::vector<int>& indices) :
+	bits(previous.bits), tables(previous.tables), projections(previous.projections), rowCodes(previous.rowCodes) {
+	hashRows(rows, indices.data());
+	fillBuckets();
+}
+template <typename Scalar>
+void SimHashTables<Scalar>::hash(const Eigen::Ref<const MatrixX<Scalar> >& inputs, Eigen::MatrixXi& codes) const {
+	MatrixX<Scalar> p = *projections * inputs;
+	codes.resize(tables, inputs.cols());
+	for (int j = 0; j < inputs.cols(); j++) {
+		for (int t = 0; t < tables; t++) {
+			int code = 0;
+			for (int b = 0; b < bits; b++)
+				code = (code << 1) | (p(t * bits + b, j) > 0 ? 1 : 0);
+			codes(t, j) = code;
+		}
+	}
+}
+template <typename Scalar>
+void SimHashTables<Scalar>::build(const RowMatrixX<Scalar>& weights) {
+	rowCodes.resize(tables, weights.rows());
+	hashRows(weights, NULL);
+	fillBuckets();
+}
+// the codes of the given rows into their columns of rowCodes, those of rows 0, 1, ... without indices
+template <typename Scalar>
+void SimHashTables<Scalar>::hashRows(const RowMatrixX<Scalar>& rows, const int* indices) {
+	Eigen::MatrixXi codes;
+	// a block of rows at a time keeps the projections of the weights small
+	const int block = 4096;
+	for (int r0 = 0; r0 < rows.rows(); r0 += block) {
+		int n = std::min<int>(block, (int)rows.rows() - r0);
+		hash(rows.middleRows(r0, n).transpose(), codes);
+		for (int j = 0; j < n; j++)
+			rowCodes.col(indices != NULL ? indices[r0 + j] : r0 + j) = codes.col(j);
+	}
+}
+// every row into its bucket of every table, in row order
+template <typename Scalar>
+void SimHashTables<Scalar>::fillBuckets() {
+	buckets.assign((size_t)tables << bits, std::vector<int>());
+	for (int r = 0; r < rowCodes.cols(); r++)
+		for (int t = 0; t < tables; t++)
+			buckets[((size_t)t << bits) + rowCodes(t, r)].push_back(r);
+}
+template <typename Scalar>
+void SimHashTables<Scalar>::query(const int* codes, std::vector<int>& rows, std::vector<char>& seen) const {
+	rows.clear();
+	for (int t = 0; t < tables; t++) {
+		const std::vector<int>& bucket = buckets[((size_t)t << bits) + codes[t]];
+		for (size_t k = 0; k < bucket.size(); k++) {
+			if (!seen[bucket[k]]) {
+				seen[bucket[k]] = 1;
+				rows.push_back(bucket[k]);
+			}
+		}
+	}
+	for (size_t k = 0; k < rows.size(); k++)
+		seen[rows[k]] = 0;
+}
+
+template <typename Scalar>
+SlideTraining<Scalar>::SlideTraining(const std::vector<MatrixX<Scalar> >& weights, int bits, int tables, int rebuildInterval) :
+	output(weights.back()), rebuildInterval(rebuildInterval), batches(0), rebuilds(0), computed(0), possible(0) {
+	std::mt19937 rng(24680);
+	size_t nHidden = weights.size() - 1;
+	for (size_t l = 0; l < nHidden; l++) {
+		hidden.push_back(weights[l]);
+		this->tables.push_back(SimHashTables<Scalar>((int)weights[l].cols(), bits, tables, rng));
+		this->tables.back().build(hidden.back());
+		seen.push_back(std::vector<char>(weights[l].rows(), 0));
+		changed.push_back(std::vector<char>(weights[l].rows(), 0));
+	}
+	acts.resize(nHidden);
+	active.resize(nHidden);
+}
+template <typename Scalar>
+SlideTraining<Scalar>::~SlideTraining() {
+	if (rebuilt.valid())
+		rebuilt.wait();
+}
+template <typename Scalar>
+void SlideTraining<Scalar>::startRebuild() {
+	// only the rows updated since the last rebuild can have moved to other buckets; they are copied
+	// so that training can go on, and the current tables are only read until the new ones replace them
+	std::vector<RowMatrixX<Scalar> > snapshot(hidden.size());
+	std::vector<std::vector<int> > indices(hidden.size());
+	for (size_t l = 0; l < hidden.size(); l++) {
+		for (int r = 0; r < (int)changed[l].size(); r++)
+			if (changed[l][r]) {
+				indices[l].push_back(r);
+				changed[l][r] = 0;
+			}
+		snapshot[l].resize(indices[l].size(), hidden[l].cols());
+		for (size_t k = 0; k < indices[l].size(); k++)
+			snapshot[l].row(k) = hidden[l].row(indices[l][k]);
+	}
+	const std::vector<SimHashTables<Scalar> >* current = &tables;
+	rebuilt = std::async(std::launch::async, [current](std::vector<RowMatrixX<Scalar> > snapshot, std::vector<std::vector<int> > indices) {
+		std::vector<SimHashTables<Scalar> > next;
+		next.reserve(current->size());
+		for (size_t l = 0; l < current->size(); l++)
+			next.push_back(SimHashTables<Scalar>((*current)[l], snapshot[l], indices[l]));
+		return next;
+	}, std::move(snapshot), std::move(indices));
+}
+template <typename Scalar>
+void SlideTraining<Scalar>::train(const Eigen::Ref<const MatrixX<Scalar> >& inputs, const Eigen::Ref<const Eigen::VectorXi>& labels, Scalar rate) {
+	if (rebuilt.valid() && rebuilt.wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+		tables = rebuilt.get();
+		rebuilds++;
+	}
+	if (rebuildInterval > 0 && ++batches % rebuildInterval == 0 && !rebuilt.valid())
+		startRebuild();
+
+	int n = (int)inputs.cols();
+	int nHidden = (int)hidden.size();
+
+	// forward: only the neurons returned by the tables, the others stay 0
+	for (int l = 0; l < nHidden; l++) {
+		const Eigen::Ref<const MatrixX<Scalar> > in = l == 0 ? inputs : Eigen::Ref<const MatrixX<Scalar> >(acts[l - 1]);
+		tables[l].hash(in, codes);
+		acts[l].setZero(hidden[l].rows(), n);
+		active[l].resize(n);
+		for (int j = 0; j < n; j++) {
+			tables[l].query(codes.col(j).data(), active[l][j], seen[l]);
+			for (size_t k = 0; k < active[l][j].size(); k++) {
+				int r = active[l][j][k];
+				Scalar v = hidden[l].row(r).dot(in.col(j));
+				acts[l](r, j) = v > 0 ? v : Scalar(0);
+			}
+			computed += active[l][j].size();
+			possible += hidden[l].rows();
+		}
+	}
+	const MatrixX<Scalar>& top = acts[nHidden - 1];
+	const std::vector<std::vector<int> >& topActive = active[nHidden - 1];
+	logits.setZero(output.rows(), n);
+	for (int j = 0; j < n; j++)
+		for (size_t k = 0; k < topActive[j].size(); k++)
+			logits.col(j) += output.col(topActive[j][k]) * top(topActive[j][k], j);
+	// the logits become the gradient at the logits
+	softmax_cross_entropy_gradient<Scalar>(logits, labels, NULL);
+
+	// backward, the gradients of the whole batch taken before the weights they go through are updated
+	Scalar step = rate / n;
+	delta.setZero(top.rows(), n);
+	for (int j = 0; j < n; j++)
+		for (size_t k = 0; k < topActive[j].size(); k++) {
+			int r = topActive[j][k];
+			if (top(r, j) > 0)
+				delta(r, j) = output.col(r).dot(logits.col(j));
+		}
+	for (int j = 0; j < n; j++)
+		for (size_t k = 0; k < topActive[j].size(); k++) {
+			int r = topActive[j][k];
+			if (top(r, j) > 0)
+				output.col(r) -= (step * top(r, j)) * logits.col(j);
+		}
+	// delta of a layer is taken through its ReLU where it is used: only the neurons with a positive
+	// activation pass it on, the others (and those not computed) have none
+	for (int l = nHidden - 1; l >= 0; l--) {
+		const Eigen::Ref<const MatrixX<Scalar> > in = l == 0 ? inputs : Eigen::Ref<const MatrixX<Scalar> >(acts[l - 1]);
+		const MatrixX<Scalar>& act = acts[l];
+		if (l > 0) {
+			prevDelta.setZero(in.rows(), n);
+			for (int j = 0; j < n; j++)
+				for (size_t k = 0; k < active[l][j].size(); k++) {
+					int r = active[l][j][k];
+					if (delta(r, j) != 0 && act(r, j) > 0)
+						prevDelta.col(j) += delta(r, j) * hidden[l].row(r).transpose();
+				}
+		}
+		for (int j = 0; j < n; j++)
+			for (size_t k = 0; k < active[l][j].size(); k++) {
+				int r = active[l][j][k];
+				if (delta(r, j) != 0 && act(r, j) > 0) {
+					hidden[l].row(r) -= (step * delta(r, j)) * in.col(j).transpose();
+					changed[l][r] = 1;
+				}
+			}
+		if (l > 0)
+			delta.swap(prevDelta);
+	}
+}
+template <typename Scalar>
+void SlideTraining<Scalar>::copyWeights(std::vector<MatrixX<Scalar> >& weights) const {
+	for (size_t l = 0; l < hidden.size(); l++)
+		weights[l] = hidden[l];
+	weights.back() = output;
+}
+template class SimHashTables<float>;
+template class SimHashTables<double>;
+template class SlideTraining<float>;
+template class SlideTraining<double>;
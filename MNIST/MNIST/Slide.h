@@ -0,0 +1,79 @@
+#pragma once
+#include "lib/Eigen/Core"
+#include <future>
+#include <memory>
+#include <random>
+#include <vector>
+#include "Util.h"
+
+template <typename Scalar> using RowMatrixX = Eigen::Matrix<Scalar, Eigen::Dynamic, Eigen::Dynamic, Eigen::RowMajor>;
+
+// Locality-sensitive hash tables over the rows of a weight matrix: every table hashes a vector to
+// the signs of bits random projections of it (SimHash), so that an input lands in the buckets of
+// the rows at a small angle to it, the neurons likely to respond strongly.
+template <typename Scalar>
+class SimHashTables {
+public:
+	SimHashTables(int dims, int bits, int tables, std::mt19937& rng);
+	// the tables of previous after only the given rows of the weights changed, to rows (one per
+	// index): those are hashed again, the others keep their codes. previous is only read, so that
+	// it can be queried meanwhile.
+	SimHashTables(const SimHashTables& previous, const RowMatrixX<Scalar>& rows, const std::vector<int>& indices);
+	// hashes every row of weights into the tables, replacing what they held
+	void build(const RowMatrixX<Scalar>& weights);
+	// the bucket of every column of inputs in every table, one column of codes per column of inputs
+	void hash(const Eigen::Ref<const MatrixX<Scalar> >& inputs, Eigen::MatrixXi& codes) const;
+	// the rows in the buckets of the given codes, each listed once; seen (one flag per row, all 0) is
+	// used to drop duplicates and left all 0 again
+	void query(const int* codes, std::vector<int>& rows, std::vector<char>& seen) const;
+private:
+	void hashRows(const RowMatrixX<Scalar>& rows, const int* indices);
+	void fillBuckets();
+
+	int bits, tables;
+	// bits * tables random +-1 directions, shared by the rebuilt tables
+	std::shared_ptr<const MatrixX<Scalar> > projections;
+	// the bucket of every row in every table, tables x rows
+	Eigen::MatrixXi rowCodes;
+	// tables * 2^bits buckets of row indices
+	std::vector<std::vector<int> > buckets;
+};
+
+// SLIDE-style training of wide hidden layers (-slide): for every sample, each hidden layer only
+// computes the neurons its hash tables return for the sample's input to that layer, and backprop and
+// the weight updates only touch those. The tables are rebuilt from the current weights every
+// rebuildInterval batches on a background thread, from a copy of the rows updated since the last
+// rebuild, and training continues on the old tables in the meantime. The hidden weights are kept row-major, so that every neuron's weights are contiguous;
+// the output layer stays dense.
+template <typename Scalar>
+class SlideTraining {
+public:
+	SlideTraining(const std::vector<MatrixX<Scalar> >& weights, int bits, int tables, int rebuildInterval);
+	~SlideTraining();
+	// one step of gradient descent on a batch
+	void train(const Eigen::Ref<const MatrixX<Scalar> >& inputs, const Eigen::Ref<const Eigen::VectorXi>& labels, Scalar rate);
+	// the current weights, laid out as the dense network's
+	void copyWeights(std::vector<MatrixX<Scalar> >& weights) const;
+	// fraction of the hidden neurons computed per sample so far
+	double activeFraction() const { return possible > 0 ? computed / possible : 0; }
+	int rebuildCount() const { return rebuilds; }
+private:
+	SlideTraining(const SlideTraining&);
+	SlideTraining& operator=(const SlideTraining&);
+	void startRebuild();
+
+	std::vector<RowMatrixX<Scalar> > hidden;
+	MatrixX<Scalar> output;
+	std::vector<SimHashTables<Scalar> > tables;
+	std::future<std::vector<SimHashTables<Scalar> > > rebuilt;
+	int rebuildInterval, batches, rebuilds;
+	double computed, possible;
+	// per layer: the activations of the batch, the neurons computed for each sample, and their flags
+	std::vector<MatrixX<Scalar> > acts;
+	std::vector<std::vector<std::vector<int> > > active;
+	std::vector<std::vector<char> > seen;
+	// per layer, the rows updated since the last rebuild started
+	std::vector<std::vector<char> > changed;
+	MatrixX<Scalar> logits, delta, prevDelta;
+	Eigen::MatrixXi codes;
+};
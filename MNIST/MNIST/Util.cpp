@@ -1,71 +1,90 @@
 #include "Util.h"
+#include "Kernels.h"
+#include <cstring>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
-void relu(MatrixXd &x) {
-	for (int j = 0; j < x.cols(); j++) {
-		for (int i = 0; i < x.rows(); i++) {
-			if (x(i, j) < 0)
-				x(i, j) = 0;
-		}
-	}
+// The kernels take plain arrays, one column after the other. A Ref also binds a block whose columns
+// are further apart (outerStride() > rows()); such an argument is passed as a packed copy, and an
+// output is copied back when the kernel is done. The matrices and workspace columns the network
+// passes are all contiguous, so this costs nothing there.
+template <typename Derived>
+static bool gapped(const Derived& m) {
+	return m.cols() > 1 && m.outerStride() != m.rows();
 }
 
-void softmax(MatrixXd &x) {
-	for (int j = 0; j < x.cols(); j++) {
-		double max = -numeric_limits<double>::max();
-		for (int i = 0; i < x.rows(); i++) {
-			if (x(i, j) > max)
-				max = x(i, j);
+template <typename Scalar>
+class Packed {
+public:
+	explicit Packed(const Ref<const MatrixX<Scalar>>& m) : ptr(m.data()) {
+		if (gapped(m)) {
+			copy = m;
+			ptr = copy.data();
 		}
-		double esum = 0;
-		for (int i = 0; i < x.rows(); i++) {
-			x(i, j) = exp(x(i, j) - max);
-			esum += x(i, j);
-		}
-		for (int i = 0; i < x.rows(); i++) {
-			x(i, j) = x(i, j) / esum;
+	}
+	const Scalar* data() const { return ptr; }
+private:
+	MatrixX<Scalar> copy;
+	const Scalar* ptr;
+};
+
+// the same for an output, read as well for the kernels that work in place
+template <typename Scalar>
+class PackedOutput {
+public:
+	PackedOutput(Ref<MatrixX<Scalar>>& m, bool inPlace) : m(m), ptr(m.data()) {
+		if (gapped(m)) {
+			if (inPlace)
+				copy = m;
+			else
+				copy.resize(m.rows(), m.cols());
+			ptr = copy.data();
 		}
 	}
-}
+	~PackedOutput() {
+		if (ptr != m.data())
+			m = copy;
+	}
+	Scalar* data() const { return ptr; }
+private:
+	PackedOutput(const PackedOutput&);
+	PackedOutput& operator=(const PackedOutput&);
+	Ref<MatrixX<Scalar>>& m;
+	MatrixX<Scalar> copy;
+	Scalar* ptr;
+};
 
-VectorXi argmax(const MatrixXd &x) {
-	VectorXi result(x.cols());
+// relu, softmax, argmax, the fused layer kernels and the loss run on the kernels picked for the CPU, see Kernels.h
+template <typename Scalar>
+void relu(Ref<MatrixX<Scalar>> x) {
+	PackedOutput<Scalar> out(x, true);
+	kernels<Scalar>().relu(out.data(), x.size());
+}
 
-	for (int j = 0; j < x.cols(); j++) {
-		int amax = -1;
-		double max = -numeric_limits<double>::max();
-		for (int i = 0; i < x.rows(); i++) {
-			if (x(i, j) > max) {
-				amax = j;
-				max = x(i, j);
-			}
-		}		
-		result(j) = amax;
-	}
+template <typename Scalar>
+void softmax(Ref<MatrixX<Scalar>> x) {
+	PackedOutput<Scalar> out(x, true);
+	kernels<Scalar>().softmax(x.rows(), x.cols(), out.data());
+}
 
+template <typename Scalar>
+VectorXi argmax(const MatrixX<Scalar> &x) {
+	VectorXi result(x.cols());
+	kernels<Scalar>().argmax((int)x.rows(), (int)x.cols(), x.data(), result.data());
 	return result;
 }
 
-double accuracy(const MatrixXd &x, const VectorXi& labels)
+template <typename Scalar>
+double accuracy(const MatrixX<Scalar> &x, const VectorXi& labels)
 {
-	int count = 0;
-
-	for (int j = 0; j < x.cols(); j++) {
-		int amax = -1;
-		double max = -numeric_limits<double>::max();
-		for (int i = 0; i < x.rows(); i++) {
-			if (x(i, j) > max) {
-				amax = i;
-				max = x(i, j);
-			}
-		}
-		if (labels(j) == amax)
-			count++;
-	}
+	int count = (argmax(x).array() == labels.array()).count();
 
 	return (double)count / (double)x.cols();
 }
 
-double cross_entropy_discrete(const MatrixXd& probs, const VectorXi& labels)
+template <typename Scalar>
+double cross_entropy_discrete(const MatrixX<Scalar>& probs, const VectorXi& labels)
 {
 	double sum = 0;
 	for (int j = 0; j < probs.cols(); j++)
@@ -73,49 +92,347 @@ double cross_entropy_discrete(const MatrixXd& probs, const VectorXi& labels)
 	return -sum / probs.cols();
 }
 
-MatrixXd crossentropy_softmax_gradient(const MatrixXd& probs, const VectorXi& labels)
+template <typename Scalar>
+void crossentropy_softmax_gradient(const Ref<const MatrixX<Scalar>>& probs, const Ref<const VectorXi>& labels, Ref<MatrixX<Scalar>> result)
 {
-	MatrixXd result = probs;
+	result = probs;
 
 	for (int j = 0; j < probs.cols(); j++)
-		result(labels(j), j) -= 1.0;
+		result(labels(j), j) -= Scalar(1);
+}
 
-	return result;
+template <typename Scalar>
+double logits_cross_entropy(const Ref<const MatrixX<Scalar>>& logits, const Ref<const VectorXi>& labels, int* hits)
+{
+	return kernels<Scalar>().logitsCrossEntropy(logits.rows(), logits.cols(), Packed<Scalar>(logits).data(), labels.data(), hits);
 }
 
-MatrixXd relu_gradient(const MatrixXd& raws, const MatrixXd& vals)
+template <typename Scalar>
+double softmax_cross_entropy_gradient(Ref<MatrixX<Scalar>> logits, const Ref<const VectorXi>& labels, int* hits)
 {
-	MatrixXd result(raws.rows(), raws.cols());
+	PackedOutput<Scalar> out(logits, true);
+	return kernels<Scalar>().softmaxCrossEntropyGradient(logits.rows(), logits.cols(), out.data(), labels.data(), hits);
+}
 
-	for (int j = 0; j < raws.cols(); j++)
-		for (int i = 0; i < raws.rows(); i++)
-			result(i, j) = (vals(i, j) > 0 ? raws(i, j) : 0.0);
+template <typename Scalar>
+void relu_gradient(Ref<MatrixX<Scalar>> grads, const Ref<const MatrixX<Scalar>>& vals)
+{
+	for (int j = 0; j < grads.cols(); j++)
+		for (int i = 0; i < grads.rows(); i++)
+			if (!(vals(i, j) > 0))
+				grads(i, j) = 0.0;
+}
 
-	return result;
+static inline int count_trailing_zeros(uint64_t word)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward64(&index, word);
+	return (int)index;
+#else
+	return __builtin_ctzll(word);
+#endif
 }
 
-void random_shuffle_in_place(vector<int>& list)
+template <typename Scalar>
+void CompactActivations::store(const Ref<const MatrixX<Scalar>>& vals)
 {
-	for (int i = list.size() - 1; i > 0; i--)
+	nRows = vals.rows();
+	nCols = vals.cols();
+	wordsPerCol = (nRows + 63) / 64;
+	bits.assign((size_t)wordsPerCol * nCols, 0);
+	colStart.resize(nCols + 1);
+	values.clear();
+	for (int j = 0; j < nCols; j++)
 	{
-		int j = rand() % i;
-		int tmp = list[j];
-		list[j] = list[i];
-		list[i] = tmp;
+		colStart[j] = values.size();
+		uint64_t* colBits = &bits[(size_t)j * wordsPerCol];
+		const Scalar* col = vals.col(j).data();
+		for (int i = 0; i < nRows; i++)
+			if (col[i] > 0)
+			{
+				colBits[i >> 6] |= (uint64_t)1 << (i & 63);
+				values.push_back((float)col[i]);
+			}
+	}
+	colStart[nCols] = values.size();
+}
+
+template <typename Scalar>
+void CompactActivations::expand(Ref<MatrixX<Scalar>> vals) const
+{
+	eigen_assert(vals.rows() == nRows && vals.cols() == nCols);
+	vals.setZero();
+	for (int j = 0; j < nCols; j++)
+	{
+		const uint64_t* colBits = &bits[(size_t)j * wordsPerCol];
+		const float* v = values.data() + colStart[j];
+		Scalar* col = vals.col(j).data();
+		for (int w = 0; w < wordsPerCol; w++)
+			for (uint64_t word = colBits[w]; word != 0; word &= word - 1)
+				col[w * 64 + count_trailing_zeros(word)] = *v++;
+	}
+}
+
+template <typename Scalar>
+void CompactActivations::maskGradient(Ref<MatrixX<Scalar>> grads) const
+{
+	for (int j = 0; j < nCols; j++)
+	{
+		const uint64_t* colBits = &bits[(size_t)j * wordsPerCol];
+		Scalar* col = grads.col(j).data();
+		for (int i = 0; i < nRows; i++)
+			if (!((colBits[i >> 6] >> (i & 63)) & 1))
+				col[i] = 0.0;
+	}
+}
+
+template <typename Scalar>
+void linear_relu(const Ref<const MatrixX<Scalar>>& weights, const Ref<const MatrixX<Scalar>>& inputs, const VectorX<Scalar>* bias, Ref<MatrixX<Scalar>> outputs)
+{
+	PackedOutput<Scalar> out(outputs, false);
+	kernels<Scalar>().linearRelu(weights.rows(), weights.cols(), inputs.cols(), Packed<Scalar>(weights).data(), Packed<Scalar>(inputs).data(), bias != NULL ? bias->data() : NULL, out.data());
+}
+
+template <typename Scalar>
+void linear_relu_gradient(const Ref<const MatrixX<Scalar>>& weights, const Ref<const MatrixX<Scalar>>& grads, const Ref<const MatrixX<Scalar>>& vals, Ref<MatrixX<Scalar>> result)
+{
+	PackedOutput<Scalar> out(result, false);
+	kernels<Scalar>().linearReluGradient(weights.rows(), weights.cols(), grads.cols(), Packed<Scalar>(weights).data(), Packed<Scalar>(grads).data(), Packed<Scalar>(vals).data(), out.data());
+}
+
+template <typename Scalar>
+void gemm(const Ref<const MatrixX<Scalar>>& a, bool transA, const Ref<const MatrixX<Scalar>>& b, bool transB, Scalar divisor, Ref<MatrixX<Scalar>> c)
+{
+	int k = transA ? a.rows() : a.cols();
+	PackedOutput<Scalar> out(c, false);
+	kernels<Scalar>().gemm(c.rows(), c.cols(), k, Packed<Scalar>(a).data(), transA, Packed<Scalar>(b).data(), transB, divisor, out.data());
+}
+
+// the same for ReLU activations held in sparse form: only the entries where vals is positive are
+// computed, each as the dot product of a column of weights with a column of grads
+template <typename Scalar>
+void sparse_linear_relu_gradient(const MatrixX<Scalar>& weights, const Ref<const MatrixX<Scalar>>& grads, const SparseMatrix<Scalar>& vals, Ref<MatrixX<Scalar>> result)
+{
+	result.setZero();
+	for (int j = 0; j < vals.outerSize(); j++)
+		for (typename SparseMatrix<Scalar>::InnerIterator it(vals, j); it; ++it)
+			if (it.value() > 0)
+				result(it.row(), j) = weights.col(it.row()).dot(grads.col(j));
+}
+
+static inline uint16_t float_to_bf16(float f)
+{
+	uint32_t u;
+	memcpy(&u, &f, 4);
+	if ((u & 0x7fffffff) > 0x7f800000)
+		return (uint16_t)((u >> 16) | 0x40);
+	u += 0x7fff + ((u >> 16) & 1);
+	return (uint16_t)(u >> 16);
+}
+
+static inline float bf16_to_float(uint16_t b)
+{
+	uint32_t u = (uint32_t)b << 16;
+	float f;
+	memcpy(&f, &u, 4);
+	return f;
+}
+
+static inline float from_16(uint16_t b, StorageFormat format)
+{
+	return format == STORAGE_BF16 ? bf16_to_float(b) : half_impl::half_to_float(half_impl::raw_uint16_to_half(b));
+}
+
+static inline uint16_t to_16(float f, StorageFormat format)
+{
+	return format == STORAGE_BF16 ? float_to_bf16(f) : half(f).x;
+}
+
+// the neighbours of a 16-bit value in sign-magnitude order, both formats alike
+static inline uint16_t next_up_16(uint16_t b)
+{
+	return b == 0x8000 ? 1 : (b & 0x8000) ? b - 1 : b + 1;
+}
+
+static inline uint16_t next_down_16(uint16_t b)
+{
+	return b == 0 ? 0x8001 : (b & 0x8000) ? b + 1 : b - 1;
+}
+
+static inline uint16_t to_16_stochastic(float f, StorageFormat format, std::mt19937& rng)
+{
+	uint16_t nearest = to_16(f, format);
+	float rounded = from_16(nearest, format);
+	if (rounded == f || !(f == f))
+		return nearest;
+	uint16_t lo = rounded < f ? nearest : next_down_16(nearest);
+	uint16_t hi = rounded < f ? next_up_16(nearest) : nearest;
+	float loValue = from_16(lo, format), hiValue = from_16(hi, format);
+	float u = (rng() >> 8) * (1.0f / 16777216);
+	return u < (f - loValue) / (hiValue - loValue) ? hi : lo;
+}
+
+template <typename Scalar>
+void pack_16(const Ref<const MatrixX<Scalar>>& src, Ref<MatrixX16> dst, StorageFormat format, std::mt19937* rng)
+{
+	eigen_assert(dst.rows() == src.rows() && dst.cols() == src.cols());
+	size_t n = src.rows();
+	for (Index j = 0; j < src.cols(); j++)
+	{
+		const Scalar* s = src.col(j).data();
+		uint16_t* d = dst.col(j).data();
+		if (rng != NULL)
+			for (size_t i = 0; i < n; i++)
+				d[i] = to_16_stochastic((float)s[i], format, *rng);
+		else
+			for (size_t i = 0; i < n; i++)
+				d[i] = to_16((float)s[i], format);
 	}
 }
 
-std::vector<std::string> split_string(std::string s, char delim) {
-	std::istringstream ss(s);
+template <typename Scalar>
+static void widen_16(const uint16_t* s, Scalar* d, size_t n, StorageFormat format)
+{
+	if (format == STORAGE_BF16)
+		for (size_t i = 0; i < n; i++)
+			d[i] = (Scalar)bf16_to_float(s[i]);
+	else
+		for (size_t i = 0; i < n; i++)
+			d[i] = (Scalar)half_impl::half_to_float(half_impl::raw_uint16_to_half(s[i]));
+}
 
-	std::vector<std::string> parts;
-	std::string part;
-	while (std::getline(ss, part, delim)) {
-		if (!part.empty()) {
-			parts.push_back(part);
+template <typename Scalar>
+void unpack_16(const Ref<const MatrixX16>& src, Ref<MatrixX<Scalar>> dst, StorageFormat format)
+{
+	eigen_assert(dst.rows() == src.rows() && dst.cols() == src.cols());
+	for (Index j = 0; j < src.cols(); j++)
+		widen_16(src.col(j).data(), dst.col(j).data(), src.rows(), format);
+}
+
+// The panels hold up to 512 KB of widened weights, which keeps the hidden layers of the usual
+// networks (up to about 160 x 784 in float) in one panel that is multiplied straight into c; wider
+// layers go through a panel of results, copied into their rows of c.
+template <typename Scalar>
+void gemm_16(const MatrixX16& a, bool transA, StorageFormat format, const Ref<const MatrixX<Scalar>>& b, bool relu, Ref<MatrixX<Scalar>> c)
+{
+	int m = c.rows(), n = c.cols(), k = transA ? a.rows() : a.cols();
+	int panelRows = std::min(m, std::max(8, (int)(524288 / sizeof(Scalar) / std::max(k, 1)) & ~7));
+	// per thread and only ever grown, so that a training step does not allocate
+	thread_local vector<Scalar> panel, result;
+	if (panel.size() < (size_t)panelRows * k)
+		panel.resize((size_t)panelRows * k);
+	if (panelRows < m && result.size() < (size_t)panelRows * n)
+		result.resize((size_t)panelRows * n);
+	const KernelTable<Scalar>& kernel = kernels<Scalar>();
+	Packed<Scalar> packedB(b);
+	PackedOutput<Scalar> packedC(c, false);
+	for (int i0 = 0; i0 < m; i0 += panelRows)
+	{
+		int rows = std::min(panelRows, m - i0);
+		if (transA)
+			// rows of a^T are the columns of a, widened as they are stored, k x rows
+			widen_16(a.data() + (size_t)i0 * k, panel.data(), (size_t)k * rows, format);
+		else
+			// these rows of every column of a, rows x k
+			for (int j = 0; j < k; j++)
+				widen_16(a.data() + (size_t)j * m + i0, panel.data() + (size_t)j * rows, rows, format);
+		Scalar* out = rows == m ? packedC.data() : result.data();
+		kernel.gemm(rows, n, k, panel.data(), transA, packedB.data(), false, Scalar(1), out);
+		if (relu)
+			kernel.relu(out, (size_t)rows * n);
+		if (out != packedC.data())
+			Map<MatrixX<Scalar>>(packedC.data(), m, n).middleRows(i0, rows) = Map<MatrixX<Scalar>>(out, rows, n);
+	}
+}
+
+template <typename Scalar>
+void sgd_update_16(MatrixX16& weights, const MatrixX<Scalar>& grads, Scalar rate, StorageFormat format, std::mt19937& rng)
+{
+	uint16_t* w = weights.data();
+	const Scalar* g = grads.data();
+	size_t n = weights.size();
+	for (size_t i = 0; i < n; i++)
+		w[i] = to_16_stochastic((float)((Scalar)from_16(w[i], format) - rate * g[i]), format, rng);
+}
+
+void bytes_to_features(const unsigned char* bytes, double* features, size_t n, double scale)
+{
+	size_t i = 0;
+#ifdef EIGEN_VECTORIZE_SSE2
+	// widen 16 bytes at a time: u8 -> u16 -> i32 -> double
+	const __m128i zero = _mm_setzero_si128();
+	const __m128d s = _mm_set1_pd(scale);
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i b = _mm_loadu_si128((const __m128i*)(bytes + i));
+		__m128i lo = _mm_unpacklo_epi8(b, zero);
+		__m128i hi = _mm_unpackhi_epi8(b, zero);
+		__m128i w[4] = { _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero), _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero) };
+		for (int k = 0; k < 4; k++)
+		{
+			_mm_storeu_pd(features + i + 4 * k, _mm_mul_pd(_mm_cvtepi32_pd(w[k]), s));
+			_mm_storeu_pd(features + i + 4 * k + 2, _mm_mul_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(w[k], _MM_SHUFFLE(1, 0, 3, 2))), s));
 		}
 	}
+#endif
+	for (; i < n; i++)
+		features[i] = bytes[i] * scale;
+}
 
-	return parts;
+void bytes_to_features(const unsigned char* bytes, float* features, size_t n, float scale)
+{
+	size_t i = 0;
+#ifdef EIGEN_VECTORIZE_SSE2
+	// widen 16 bytes at a time: u8 -> u16 -> i32 -> float
+	const __m128i zero = _mm_setzero_si128();
+	const __m128 s = _mm_set1_ps(scale);
+	for (; i + 16 <= n; i += 16)
+	{
+		__m128i b = _mm_loadu_si128((const __m128i*)(bytes + i));
+		__m128i lo = _mm_unpacklo_epi8(b, zero);
+		__m128i hi = _mm_unpackhi_epi8(b, zero);
+		__m128i w[4] = { _mm_unpacklo_epi16(lo, zero), _mm_unpackhi_epi16(lo, zero), _mm_unpacklo_epi16(hi, zero), _mm_unpackhi_epi16(hi, zero) };
+		for (int k = 0; k < 4; k++)
+			_mm_storeu_ps(features + i + 4 * k, _mm_mul_ps(_mm_cvtepi32_ps(w[k]), s));
+	}
+#endif
+	for (; i < n; i++)
+		features[i] = bytes[i] * scale;
+}
+
+void random_shuffle_in_place(vector<int>& list)
+{
+	for (int i = list.size() - 1; i > 0; i--)
+	{
+		int j = rand() % i;
+		int tmp = list[j];
+		list[j] = list[i];
+		list[i] = tmp;
+	}
 }
 
+// the precisions the network can run in, see -precision
+#define INSTANTIATE_UTIL(Scalar) \
+	template void relu<Scalar>(Ref<MatrixX<Scalar>>); \
+	template void softmax<Scalar>(Ref<MatrixX<Scalar>>); \
+	template VectorXi argmax<Scalar>(const MatrixX<Scalar>&); \
+	template double accuracy<Scalar>(const MatrixX<Scalar>&, const VectorXi&); \
+	template double cross_entropy_discrete<Scalar>(const MatrixX<Scalar>&, const VectorXi&); \
+	template void crossentropy_softmax_gradient<Scalar>(const Ref<const MatrixX<Scalar>>&, const Ref<const VectorXi>&, Ref<MatrixX<Scalar>>); \
+	template double logits_cross_entropy<Scalar>(const Ref<const MatrixX<Scalar>>&, const Ref<const VectorXi>&, int*); \
+	template double softmax_cross_entropy_gradient<Scalar>(Ref<MatrixX<Scalar>>, const Ref<const VectorXi>&, int*); \
+	template void relu_gradient<Scalar>(Ref<MatrixX<Scalar>>, const Ref<const MatrixX<Scalar>>&); \
+	template void linear_relu<Scalar>(const Ref<const MatrixX<Scalar>>&, const Ref<const MatrixX<Scalar>>&, const VectorX<Scalar>*, Ref<MatrixX<Scalar>>); \
+	template void linear_relu_gradient<Scalar>(const Ref<const MatrixX<Scalar>>&, const Ref<const MatrixX<Scalar>>&, const Ref<const MatrixX<Scalar>>&, Ref<MatrixX<Scalar>>); \
+	template void gemm<Scalar>(const Ref<const MatrixX<Scalar>>&, bool, const Ref<const MatrixX<Scalar>>&, bool, Scalar, Ref<MatrixX<Scalar>>); \
+	template void sparse_linear_relu_gradient<Scalar>(const MatrixX<Scalar>&, const Ref<const MatrixX<Scalar>>&, const SparseMatrix<Scalar>&, Ref<MatrixX<Scalar>>); \
+	template void CompactActivations::store<Scalar>(const Ref<const MatrixX<Scalar>>&); \
+	template void CompactActivations::expand<Scalar>(Ref<MatrixX<Scalar>>) const; \
+	template void CompactActivations::maskGradient<Scalar>(Ref<MatrixX<Scalar>>) const; \
+	template void pack_16<Scalar>(const Ref<const MatrixX<Scalar>>&, Ref<MatrixX16>, StorageFormat, std::mt19937*); \
+	template void unpack_16<Scalar>(const Ref<const MatrixX16>&, Ref<MatrixX<Scalar>>, StorageFormat); \
+	template void gemm_16<Scalar>(const MatrixX16&, bool, StorageFormat, const Ref<const MatrixX<Scalar>>&, bool, Ref<MatrixX<Scalar>>); \
+	template void sgd_update_16<Scalar>(MatrixX16&, const MatrixX<Scalar>&, Scalar, StorageFormat, std::mt19937&);
+INSTANTIATE_UTIL(float)
+INSTANTIATE_UTIL(double)
@@ -6,18 +6,129 @@
 #include <sstream>
 #include <stdio.h>
 #include <limits>
+#include <cstdint>
+#include <random>
+#include <atomic>
+#include <thread>
 
 #include "lib/Eigen/Core"
+#include "lib/Eigen/SparseCore"
 
 using namespace std;
 using namespace Eigen;
 
-void relu(MatrixXd &x);
-void softmax(MatrixXd &x);
-VectorXi argmax(const MatrixXd &x);
-double accuracy(const MatrixXd &x, const VectorXi& labels);
-double cross_entropy_discrete(const MatrixXd& probs, const VectorXi& labels);
-MatrixXd crossentropy_softmax_gradient(const MatrixXd& probs, const VectorXi& labels);
-MatrixXd relu_gradient(const MatrixXd& raws, const MatrixXd& vals);
+#if !EIGEN_VERSION_AT_LEAST(3, 4, 0)
+// as defined by Eigen 3.4
+template <typename Scalar> using MatrixX = Matrix<Scalar, Dynamic, Dynamic>;
+template <typename Scalar> using VectorX = Matrix<Scalar, Dynamic, 1>;
+template <typename Scalar> using RowVectorX = Matrix<Scalar, 1, Dynamic>;
+#endif
+
+// The network runs in float or double (see -precision); Util.cpp instantiates both. The kernels
+// write into outputs already of the right size, such as the leading columns of the buffers of a
+// Workspace (MotionLearn.cpp). A Ref argument with a gap between its columns (m.topRows(k)) is
+// copied to a packed matrix first, and outputs back from it. The scalar type has to be given
+// (gemm<Scalar>(...)), as it is not deduced through a Ref.
+template <typename Scalar> void relu(Ref<MatrixX<Scalar>> x);
+template <typename Scalar> void softmax(Ref<MatrixX<Scalar>> x);
+template <typename Scalar> VectorXi argmax(const MatrixX<Scalar> &x);
+template <typename Scalar> double accuracy(const MatrixX<Scalar> &x, const VectorXi& labels);
+template <typename Scalar> double cross_entropy_discrete(const MatrixX<Scalar>& probs, const VectorXi& labels);
+template <typename Scalar> void crossentropy_softmax_gradient(const Ref<const MatrixX<Scalar>>& probs, const Ref<const VectorXi>& labels, Ref<MatrixX<Scalar>> result);
+// evaluation only: the summed cross entropy of the logits, and the number of columns whose largest
+// logit is the label added to *hits, from one max/argmax scan and one log-sum-exp per column
+template <typename Scalar> double logits_cross_entropy(const Ref<const MatrixX<Scalar>>& logits, const Ref<const VectorXi>& labels, int* hits);
+template <typename Scalar> double softmax_cross_entropy_gradient(Ref<MatrixX<Scalar>> logits, const Ref<const VectorXi>& labels, int* hits);
+template <typename Scalar> void relu_gradient(Ref<MatrixX<Scalar>> grads, const Ref<const MatrixX<Scalar>>& vals);
+template <typename Scalar> void linear_relu(const Ref<const MatrixX<Scalar>>& weights, const Ref<const MatrixX<Scalar>>& inputs, const VectorX<Scalar>* bias, Ref<MatrixX<Scalar>> outputs);
+template <typename Scalar> void linear_relu_gradient(const Ref<const MatrixX<Scalar>>& weights, const Ref<const MatrixX<Scalar>>& grads, const Ref<const MatrixX<Scalar>>& vals, Ref<MatrixX<Scalar>> result);
+// c = op(a) * op(b) / divisor, op transposing where asked; c must not alias a or b
+template <typename Scalar> void gemm(const Ref<const MatrixX<Scalar>>& a, bool transA, const Ref<const MatrixX<Scalar>>& b, bool transB, Scalar divisor, Ref<MatrixX<Scalar>> c);
+template <typename Scalar> void sparse_linear_relu_gradient(const MatrixX<Scalar>& weights, const Ref<const MatrixX<Scalar>>& grads, const SparseMatrix<Scalar>& vals, Ref<MatrixX<Scalar>> result);
+
+// the same into a matrix first resized to fit, for the buffers that are not in a workspace
+template <typename Scalar>
+void linear_relu(const Ref<const MatrixX<Scalar>>& weights, const Ref<const MatrixX<Scalar>>& inputs, const VectorX<Scalar>* bias, MatrixX<Scalar>& outputs)
+{
+	outputs.resize(weights.rows(), inputs.cols());
+	linear_relu<Scalar>(weights, inputs, bias, Ref<MatrixX<Scalar>>(outputs));
+}
+template <typename Scalar>
+void linear_relu_gradient(const Ref<const MatrixX<Scalar>>& weights, const Ref<const MatrixX<Scalar>>& grads, const Ref<const MatrixX<Scalar>>& vals, MatrixX<Scalar>& result)
+{
+	result.resize(weights.cols(), grads.cols());
+	linear_relu_gradient<Scalar>(weights, grads, vals, Ref<MatrixX<Scalar>>(result));
+}
+template <typename Scalar>
+void gemm(const Ref<const MatrixX<Scalar>>& a, bool transA, const Ref<const MatrixX<Scalar>>& b, bool transB, Scalar divisor, MatrixX<Scalar>& c)
+{
+	c.resize(transA ? a.cols() : a.rows(), transB ? b.rows() : b.cols());
+	gemm<Scalar>(a, transA, b, transB, divisor, Ref<MatrixX<Scalar>>(c));
+}
+
+// The activations of a ReLU layer saved for backprop in compact form: one bit per element telling
+// whether it is positive, and the positive values alone, as floats, packed column after column.
+// At the usual ReLU sparsity this takes a fraction of the dense matrix.
+class CompactActivations {
+public:
+	CompactActivations() : nRows(0), nCols(0), wordsPerCol(0) {}
+	template <typename Scalar> void store(const Ref<const MatrixX<Scalar>>& vals);
+	// the dense activations again (zero where they were not positive), into vals of their size
+	template <typename Scalar> void expand(Ref<MatrixX<Scalar>> vals) const;
+	// relu_gradient in place: zeroes grads wherever the activation was not positive
+	template <typename Scalar> void maskGradient(Ref<MatrixX<Scalar>> grads) const;
+	size_t bytes() const { return bits.size() * sizeof(uint64_t) + values.size() * sizeof(float) + colStart.size() * sizeof(size_t); }
+private:
+	int nRows, nCols, wordsPerCol;
+	vector<uint64_t> bits;
+	vector<size_t> colStart;
+	vector<float> values;
+};
+
+// 16-bit storage formats (-precision bf16|half): values are kept in 16 bits and computed on in float.
+enum StorageFormat { STORAGE_NATIVE, STORAGE_BF16, STORAGE_HALF };
+typedef Matrix<uint16_t, Dynamic, Dynamic> MatrixX16;
+// rounds to the nearest 16-bit value (ties to even), or with an rng stochastically, to either
+// neighbour with a probability given by the distance to it, so that rounding errors cancel on average.
+// Both directions write a dst of the size of src; the overloads taking a matrix resize it first.
+template <typename Scalar> void pack_16(const Ref<const MatrixX<Scalar>>& src, Ref<MatrixX16> dst, StorageFormat format, std::mt19937* rng = NULL);
+template <typename Scalar> void unpack_16(const Ref<const MatrixX16>& src, Ref<MatrixX<Scalar>> dst, StorageFormat format);
+template <typename Scalar>
+void pack_16(const Ref<const MatrixX<Scalar>>& src, MatrixX16& dst, StorageFormat format, std::mt19937* rng = NULL)
+{
+	dst.resize(src.rows(), src.cols());
+	pack_16<Scalar>(src, Ref<MatrixX16>(dst), format, rng);
+}
+template <typename Scalar>
+void unpack_16(const Ref<const MatrixX16>& src, MatrixX<Scalar>& dst, StorageFormat format)
+{
+	dst.resize(src.rows(), src.cols());
+	unpack_16<Scalar>(src, Ref<MatrixX<Scalar>>(dst), format);
+}
+// c = op(a) * b for 16-bit a, and with relu max(c, 0): a is widened a panel of rows of op(a) at a
+// time into a buffer that stays in cache and multiplied from there, so that the product reads a in
+// 16 bits and a widened copy of it never goes through memory
+template <typename Scalar> void gemm_16(const MatrixX16& a, bool transA, StorageFormat format, const Ref<const MatrixX<Scalar>>& b, bool relu, Ref<MatrixX<Scalar>> c);
+// weights -= rate * grads, rounded stochastically into the 16-bit weights (see pack_16)
+template <typename Scalar> void sgd_update_16(MatrixX16& weights, const MatrixX<Scalar>& grads, Scalar rate, StorageFormat format, std::mt19937& rng);
+
+// runs body(0) .. body(n - 1) on up to one thread per core and waits for all of them
+template <typename Body>
+void parallelFor(int n, const Body& body) {
+	std::atomic<int> nextIndex(0);
+	auto work = [&]() {
+		for (int k = nextIndex++; k < n; k = nextIndex++)
+			body(k);
+	};
+	int nThreads = std::min<int>(n, std::max(1u, std::thread::hardware_concurrency()));
+	std::vector<std::thread> workers;
+	for (int t = 1; t < nThreads; t++)
+		workers.push_back(std::thread(work));
+	work();
+	for (size_t t = 0; t < workers.size(); t++)
+		workers[t].join();
+}
+
+void bytes_to_features(const unsigned char* bytes, double* features, size_t n, double scale);
+void bytes_to_features(const unsigned char* bytes, float* features, size_t n, float scale);
 void random_shuffle_in_place(vector<int>& list);
-vector<string> split_string(string s, char delim);
\ No newline at end of file